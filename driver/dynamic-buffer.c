@@ -10,27 +10,185 @@
 #include <linux/list.h>
 #include <linux/fs.h>
 #include <linux/pid.h>
+#include <linux/pipe_fs_i.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/tty.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/version.h>
 #include "lib/defines.h"
 
+/* cache of data segment descriptors */
+static struct kmem_cache *segment_cache;
+
+/* cache of buffers, aligned to cache lines */
+static struct kmem_cache *buffer_cache;
+
+/* cache of the stamps of data segments of sharded flows */
+static struct kmem_cache *stamps_cache;
+
+/* operations of pipe buffers that reference a chunk */
+static const struct pipe_buf_operations chunk_pipe_buf_ops = {
+        .release = generic_pipe_buf_release,
+        .get = generic_pipe_buf_get
+};
+
+/**
+ * init_buffer_caches - creation of the caches for buffers and data segments
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+int init_buffer_caches(void)
+{
+        segment_cache = kmem_cache_create("multi-flow-segment", sizeof(data_segment_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+        if (unlikely(!segment_cache))
+                return -ENOMEM;
+
+        buffer_cache = kmem_cache_create("multi-flow-buffer", sizeof(dynamic_buffer_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+        if (unlikely(!buffer_cache)) {
+                kmem_cache_destroy(segment_cache);
+                return -ENOMEM;
+        }
+
+        stamps_cache = kmem_cache_create("multi-flow-stamps", sizeof(segment_stamps_t), 0, 0, NULL);
+        if (unlikely(!stamps_cache)) {
+                kmem_cache_destroy(buffer_cache);
+                kmem_cache_destroy(segment_cache);
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
+/**
+ * destroy_buffer_caches - destruction of the caches for buffers and data segments
+ */
+void destroy_buffer_caches(void)
+{
+        kmem_cache_destroy(stamps_cache);
+        kmem_cache_destroy(buffer_cache);
+        kmem_cache_destroy(segment_cache);
+}
+
 /**
- * init_dynamic_buffer - initialization of buffer
- * @buffer:     pointer to buffer to initialize
+ * init_chunk_pool - initialization of chunk pool
+ * @pool:       pointer to pool to initialize
  */
-void init_dynamic_buffer(dynamic_buffer_t *buffer)
+void init_chunk_pool(chunk_pool_t *pool)
 {
-        struct list_head *head;
+        INIT_LIST_HEAD(&(pool->free_list));
+        spin_lock_init(&(pool->lock));
+        pool->count = 0;
+}
+
+/**
+ * get_chunk - take a chunk from pool, allocate a new one if pool is empty
+ * @pool:       pointer to pool
+ * @flags:      flags used for allocation
+ * 
+ * Returns pointer to chunk, NULL if allocation fails.
+ */
+static char *get_chunk(chunk_pool_t *pool, gfp_t flags)
+{
+        struct list_head *chunk;
 
-        head = &(buffer->head);
+        chunk = NULL;
 
-        mutex_init(&(buffer->op_mutex));
+        spin_lock(&(pool->lock));
+        if (!list_empty(&(pool->free_list))) {
+                chunk = pool->free_list.next;
+                list_del(chunk);
+                pool->count--;
+        }
+        spin_unlock(&(pool->lock));
 
-        init_waitqueue_head(&(buffer->waitqueue));
+        if (chunk)
+                return (char *)chunk;
 
-        INIT_LIST_HEAD(head);
+        return (char *)__get_free_page(flags);
+}
+
+/**
+ * put_chunk - give back a chunk to pool, free it if pool is full
+ * @pool:       pointer to pool
+ * @chunk:      chunk to give back
+ * 
+ * A chunk still referenced by a pipe is never recycled, dropping our
+ * reference leaves to the pipe the release of its page.
+ */
+static void put_chunk(chunk_pool_t *pool, char *chunk)
+{
+        spin_lock(&(pool->lock));
+        if (pool->count < CHUNK_POOL_SIZE && page_count(virt_to_page(chunk)) == 1) {
+                list_add((struct list_head *)chunk, &(pool->free_list));
+                pool->count++;
+                chunk = NULL;
+        }
+        spin_unlock(&(pool->lock));
+
+        if (chunk)
+                free_page((unsigned long)chunk);
+}
+
+/**
+ * free_chunk_pool - free all chunks in pool
+ * @pool:       pointer to pool to free
+ */
+void free_chunk_pool(chunk_pool_t *pool)
+{
+        struct list_head *cur;
+        struct list_head *next;
+
+        list_for_each_safe(cur, next, &(pool->free_list)) {
+                list_del(cur);
+                free_page((unsigned long)cur);
+        }
+
+        pool->count = 0;
+}
+
+/**
+ * alloc_dynamic_buffer - allocation and initialization of buffer
+ * @pool:       pointer to pool of chunks used by buffer
+ * 
+ * The queue starts with a dummy data segment without chunk, so head and
+ * tail are never NULL and consumers and producers never share a field.
+ * 
+ * Returns pointer to buffer, NULL if allocation fails.
+ */
+dynamic_buffer_t *alloc_dynamic_buffer(chunk_pool_t *pool)
+{
+        dynamic_buffer_t *buffer;
+        data_segment_t *dummy;
+
+        buffer = kmem_cache_zalloc(buffer_cache, GFP_KERNEL);
+        if (unlikely(!buffer))
+                return NULL;
+
+        dummy = kmem_cache_alloc(segment_cache, GFP_KERNEL);
+        if (unlikely(!dummy)) {
+                kmem_cache_free(buffer_cache, buffer);
+                return NULL;
+        }
+
+        init_data_segment(dummy, NULL, 0);
+
+        buffer->head = dummy;
+        buffer->tail = dummy;
+
+        mutex_init(&(buffer->head_mutex));
+        mutex_init(&(buffer->tail_mutex));
+
+        INIT_LIST_HEAD(&(buffer->cursors));
+
+        init_waitqueue_head(&(buffer->readers));
+        init_waitqueue_head(&(buffer->writers));
+
+        buffer->pool = pool;
+        buffer->capacity = MAX_BYTE_IN_BUFFER;
+
+        return buffer;
 }
 
 /**
@@ -41,76 +199,781 @@ void init_dynamic_buffer(dynamic_buffer_t *buffer)
  */
 void init_data_segment(data_segment_t *element, char *content, int len)
 {
+        element->next = NULL;
+        element->stamps = NULL;
+        element->refs = 0;
+        element->shared = false;
         element->content = content;
         element->size = len;
         element->byte_read = 0;
 }
 
 /**
- * write_dynamic_buffer - put in list a new data segment
+ * link_segment - append a data segment at the tail of buffer
  * @buffer:     pointer to buffer in edit
- * @segment:    pointer to data segment to add
+ * @segment:    data segment to append, its content is already written
+ * 
+ * The caller holds tail_mutex. The release store publishes the content
+ * of @segment before consumers can reach it.
+ */
+static void link_segment(dynamic_buffer_t *buffer, data_segment_t *segment)
+{
+        segment->next = NULL;
+
+        smp_store_release(&(buffer->tail->next), segment);
+
+        buffer->tail = segment;
+}
+
+/**
+ * head_segment - data segment at the head of buffer with bytes to read
+ * @buffer:     pointer to buffer to read
+ * 
+ * Fully read data segments that have a successor are given back to
+ * pool. The last data segment is kept even when fully read, because
+ * producers may still append to it. The caller holds head_mutex.
+ * 
+ * Returns pointer to data segment, NULL if buffer is empty.
+ */
+static data_segment_t *head_segment(dynamic_buffer_t *buffer)
+{
+        data_segment_t *cur_seg;
+        data_segment_t *next_seg;
+
+        for (;;) {
+                cur_seg = buffer->head;
+
+                // the size of a data segment is final once it has a successor
+                next_seg = smp_load_acquire(&(cur_seg->next));
+                if (smp_load_acquire(&(cur_seg->size)) > cur_seg->byte_read)
+                        return cur_seg;
+
+                if (!next_seg)
+                        return NULL;
+
+                buffer->head = next_seg;
+                free_data_segment(buffer->pool, cur_seg);
+        }
+}
+
+/**
+ * alloc_data_segment - allocation of data segment
+ * @pool:       pointer to pool of chunks
+ * @flags:      flags used for allocation
+ * 
+ * Returns pointer to an empty data segment backed by a chunk, NULL if
+ * allocation fails.
+ */
+static data_segment_t *alloc_data_segment(chunk_pool_t *pool, gfp_t flags)
+{
+        char *content;
+        data_segment_t *segment;
+
+        segment = kmem_cache_alloc(segment_cache, flags);
+        if (unlikely(!segment))
+                return NULL;
+
+        content = get_chunk(pool, flags);
+        if (unlikely(!content)) {
+                kmem_cache_free(segment_cache, segment);
+                return NULL;
+        }
+
+        init_data_segment(segment, content, 0);
+
+        return segment;
+}
+
+/**
+ * alloc_data_segments - allocation of the chunks needed to stage a write
+ * @pool:       pointer to pool of chunks
+ * @staging:    list that receives the empty data segments
+ * @len:        number of bytes to stage
+ * @flags:      flags used for allocation
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+int alloc_data_segments(chunk_pool_t *pool, struct list_head *staging, int len, gfp_t flags)
+{
+        data_segment_t *segment;
+
+        for (; len > 0; len -= CHUNK_SIZE) {
+                segment = alloc_data_segment(pool, flags);
+                if (unlikely(!segment)) {
+                        free_data_segments(pool, staging);
+                        return -ENOMEM;
+                }
+
+                list_add_tail(&(segment->list), staging);
+        }
+
+        return 0;
+}
+
+/**
+ * share_data_segments - reference filled data segments from a staging list
+ * @pool:       pointer to pool of chunks of the new data segments
+ * @staging:    list that receives the new data segments
+ * @source:     list of filled data segments
+ * @flags:      flags used for allocation
+ * 
+ * The new data segments reference the chunks of @source, data is never
+ * copied. Every chunk gets one more page reference, so it is released by
+ * its last user, and it is never filled further.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+int share_data_segments(chunk_pool_t *pool, struct list_head *staging, struct list_head *source, gfp_t flags)
+{
+        data_segment_t *segment;
+        data_segment_t *cur_seg;
+
+        list_for_each_entry(cur_seg, source, list) {
+                segment = kmem_cache_alloc(segment_cache, flags);
+                if (unlikely(!segment)) {
+                        free_data_segments(pool, staging);
+                        return -ENOMEM;
+                }
+
+                get_page(virt_to_page(cur_seg->content));
+                init_data_segment(segment, cur_seg->content, cur_seg->size);
+                segment->shared = true;
+
+                list_add_tail(&(segment->list), staging);
+        }
+
+        return 0;
+}
+
+/**
+ * stamp_data_segments - give stamps to empty data segments of a sharded flow
+ * @staging:    list of empty data segments
+ * @flags:      flags used for allocation
+ * 
+ * Only the writes of a flow sharded by CPU are stamped, so only their data
+ * segments pay for the stamps. On failure the data segments that already
+ * have stamps keep them, they are freed with the data segments.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
  */
-void write_dynamic_buffer(dynamic_buffer_t *buffer, data_segment_t *segment)
+int stamp_data_segments(struct list_head *staging, gfp_t flags)
 {
-        list_add_tail(&(segment->list),&(buffer->head));
+        data_segment_t *cur_seg;
+
+        list_for_each_entry(cur_seg, staging, list) {
+                if (cur_seg->stamps)
+                        continue;
+
+                cur_seg->stamps = kmem_cache_zalloc(stamps_cache, flags);
+                if (unlikely(!cur_seg->stamps))
+                        return -ENOMEM;
+        }
+
+        return 0;
+}
+
+/**
+ * put_record_header - start staged data segments with the header of a record
+ * @staging:    list of empty data segments
+ * @len:        number of bytes of the record
+ */
+void put_record_header(struct list_head *staging, u32 len)
+{
+        data_segment_t *first;
+
+        first = list_first_entry(staging, data_segment_t, list);
+
+        memcpy(first->content, &len, RECORD_HEADER_SIZE);
+        first->size = RECORD_HEADER_SIZE;
+}
+
+/**
+ * copy_segments_from_iter - fill staged data segments with user data
+ * @staging:    list of data segments, filled only by a record header if any
+ * @from:       iterator over user data to write
+ * @len:        number of bytes to copy
+ * 
+ * Returns number of bytes copied, it is smaller than @len when a fault
+ * occurs.
+ */
+int copy_segments_from_iter(struct list_head *staging, struct iov_iter *from, int len)
+{
+        int to_copy;
+        int copied;
+        int byte_copied;
+        data_segment_t *cur_seg;
+
+        byte_copied = 0;
+
+        list_for_each_entry(cur_seg, staging, list) {
+                if (byte_copied == len)
+                        break;
+
+                to_copy = min_t(int, len - byte_copied, CHUNK_SIZE - cur_seg->size);
+                copied = copy_from_iter(cur_seg->content + cur_seg->size, to_copy, from);
+                cur_seg->size += copied;
+                byte_copied += copied;
+
+                if (copied < to_copy)
+                        break;
+        }
+
+        return byte_copied;
+}
+
+/**
+ * trim_data_segments - cut staged data segments to a certain size
+ * @pool:       pointer to pool of chunks
+ * @staging:    list of staged data segments
+ * @len:        number of bytes to keep
+ * 
+ * Data segments left empty are given back to pool.
+ */
+void trim_data_segments(chunk_pool_t *pool, struct list_head *staging, int len)
+{
+        data_segment_t *cur_seg;
+        data_segment_t *next_seg;
+
+        list_for_each_entry_safe(cur_seg, next_seg, staging, list) {
+                if (len <= 0 || cur_seg->size == 0) {
+                        list_del(&(cur_seg->list));
+                        free_data_segment(pool, cur_seg);
+                        continue;
+                }
+
+                if (cur_seg->size > len)
+                        cur_seg->size = len;
+                len -= cur_seg->size;
+        }
+}
+
+/**
+ * write_dynamic_buffer - append staged data segments to buffer
+ * @buffer:     pointer to buffer in edit
+ * @staging:    list of staged data segments to add
+ * 
+ * The spare space of the chunk at the tail of buffer is filled first,
+ * so small writes are coalesced in the same chunk. The remaining staged
+ * data segments are linked to the queue as they are. Cursors of a
+ * broadcast flow read data segments from their start, so there staged
+ * data segments are always linked whole. The caller holds tail_mutex.
+ */
+void write_dynamic_buffer(dynamic_buffer_t *buffer, struct list_head *staging)
+{
+        int to_move;
+        data_segment_t *tail;
+        data_segment_t *cur_seg;
+        data_segment_t *next_seg;
+
+        tail = buffer->tail;
+
+        while (!list_empty(staging) && !buffer->broadcast && tail->content && !tail->shared &&
+                        tail->size < CHUNK_SIZE) {
+                cur_seg = list_first_entry(staging, data_segment_t, list);
+                to_move = min_t(int, CHUNK_SIZE - tail->size, cur_seg->size - cur_seg->byte_read);
+
+                memcpy(tail->content + tail->size, cur_seg->content + cur_seg->byte_read, to_move);
+                smp_store_release(&(tail->size), tail->size + to_move);
+                cur_seg->byte_read += to_move;
+
+                if (cur_seg->byte_read == cur_seg->size) {
+                        list_del(&(cur_seg->list));
+                        free_data_segment(buffer->pool, cur_seg);
+                }
+        }
+
+        list_for_each_entry_safe(cur_seg, next_seg, staging, list) {
+                list_del(&(cur_seg->list));
+                link_segment(buffer, cur_seg);
+        }
+}
+
+/**
+ * copy_to_dynamic_buffer - copy user data at the tail of buffer
+ * @buffer:     pointer to buffer in edit
+ * @spare:      list of empty data segments to use when tail chunk is full
+ * @from:       iterator over user data to write
+ * @len:        number of bytes to write
+ * @stamp:      stamp of the write, 0 if the write has none
+ * 
+ * Data is copied straight in the chunks of buffer, starting from the
+ * spare space of the tail chunk, except in broadcast mode, where the
+ * tail may be a chunk consumed before the mode was selected. Stamped
+ * writes are coalesced only with stamped writes, up to SEGMENT_STAMPS
+ * per data segment, and every one marks the offset where it starts, so
+ * readers still see the stamp of each byte. Only data segments with
+ * stamps take stamped writes, so @spare must come from
+ * stamp_data_segments() when @stamp is set. The caller holds tail_mutex, so page faults are disabled
+ * and the copy stops at the first not resident page: the caller must
+ * drop the mutex and fault the page in before retrying.
+ * 
+ * Returns number of bytes copied.
+ */
+int copy_to_dynamic_buffer(dynamic_buffer_t *buffer, struct list_head *spare, struct iov_iter *from, int len, u64 stamp)
+{
+        int to_copy;
+        int copied;
+        int byte_copied;
+        data_segment_t *tail;
+        data_segment_t *segment;
+
+        tail = buffer->tail;
+        byte_copied = 0;
+
+        pagefault_disable();
+
+        // fill the spare space of tail chunk, consumers may be reading it
+        if (!buffer->broadcast && tail->content && !tail->shared && tail->size < CHUNK_SIZE &&
+                        (stamp ? tail->stamps && tail->stamps->count && tail->stamps->count < SEGMENT_STAMPS :
+                         !tail->stamps || !tail->stamps->count)) {
+                // the mark is published with the bytes it stamps
+                if (stamp) {
+                        tail->stamps->stamps[tail->stamps->count] = stamp;
+                        tail->stamps->marks[tail->stamps->count] = tail->size;
+                        smp_store_release(&(tail->stamps->count), tail->stamps->count + 1);
+                }
+
+                to_copy = min_t(int, len, CHUNK_SIZE - tail->size);
+                copied = copy_from_iter(tail->content + tail->size, to_copy, from);
+                smp_store_release(&(tail->size), tail->size + copied);
+                byte_copied += copied;
+
+                if (copied < to_copy)
+                        goto out;
+        }
+
+        // fill new chunks before they are linked
+        while (byte_copied < len && !list_empty(spare)) {
+                segment = list_first_entry(spare, data_segment_t, list);
+                if (unlikely(stamp && !segment->stamps))
+                        break;
+
+                to_copy = min_t(int, len - byte_copied, CHUNK_SIZE);
+                copied = copy_from_iter(segment->content, to_copy, from);
+                if (copied == 0)
+                        break;
+
+                list_del(&(segment->list));
+                segment->size = copied;
+                if (stamp) {
+                        segment->stamps->stamps[0] = stamp;
+                        segment->stamps->marks[0] = 0;
+                        segment->stamps->count = 1;
+                }
+                link_segment(buffer, segment);
+                byte_copied += copied;
+
+                if (copied < to_copy)
+                        break;
+        }
+
+out:
+        pagefault_enable();
+
+        return byte_copied;
+}
+
+/**
+ * walk_dynamic_buffer - walk data in buffer from its head
+ * @buffer:             pointer to buffer to walk
+ * @to:                 iterator over user memory that receives data, NULL to skip it
+ * @skip:               bytes to pass before the walk, only for a peek
+ * @len:                bytes number to be walked
+ * @peek:               true if data is left in buffer
+ * 
+ * Data is copied one chunk run at a time straight to user space. Unless
+ * @peek is set, the walked bytes are consumed and fully read chunks are
+ * given back to pool. The caller holds head_mutex, so page faults are
+ * disabled and only the bytes actually copied are consumed.
+ * 
+ * Returns number of bytes walked.
+ */
+static int walk_dynamic_buffer(dynamic_buffer_t *buffer, struct iov_iter *to, int skip, int len, bool peek)
+{
+        int offset;
+        int to_skip;
+        int to_read;
+        int copied;
+        int byte_read;
+        data_segment_t *cur_seg;
+
+        byte_read = 0;
+
+        // pairs with the barrier of add_byte_in_buffer
+        smp_rmb();
+
+        cur_seg = head_segment(buffer);
+        offset = cur_seg ? cur_seg->byte_read : 0;
+
+        while (skip > 0 && cur_seg) {
+                to_skip = min(skip, smp_load_acquire(&(cur_seg->size)) - offset);
+                offset += to_skip;
+                skip -= to_skip;
+
+                if (skip > 0) {
+                        cur_seg = smp_load_acquire(&(cur_seg->next));
+                        offset = 0;
+                }
+        }
+
+        if (to)
+                pagefault_disable();
+
+        while (byte_read < len && cur_seg) {
+                to_read = min(len - byte_read, smp_load_acquire(&(cur_seg->size)) - offset);
+
+                copied = to ? copy_to_iter(cur_seg->content + offset, to_read, to) : to_read;
+
+                offset += copied;
+                byte_read += copied;
+
+                if (!peek)
+                        cur_seg->byte_read = offset;
+
+                if (copied < to_read)
+                        break;
+
+                // the data segment is over, a peek does not free it
+                if (peek) {
+                        cur_seg = smp_load_acquire(&(cur_seg->next));
+                        offset = 0;
+                } else {
+                        cur_seg = head_segment(buffer);
+                        offset = cur_seg ? cur_seg->byte_read : 0;
+                }
+        }
+
+        if (to)
+                pagefault_enable();
+
+        return byte_read;
 }
 
 /**
  * read_dynamic_buffer - read data in buffer
  * @buffer:             pointer to buffer to read
- * @read_content:       buffer that containt read data
+ * @to:                 iterator over user memory that receives read data
  * @len:                bytes number to be read
+ * 
+ * Returns number of bytes read.
  */
-void read_dynamic_buffer(dynamic_buffer_t *buffer, char *read_content, int len)
+int read_dynamic_buffer(dynamic_buffer_t *buffer, struct iov_iter *to, int len)
 {
-        struct list_head *cur;
-        struct list_head *old;
-        struct list_head *head;
+        return walk_dynamic_buffer(buffer, to, 0, len, false);
+}
+
+/**
+ * peek_dynamic_buffer - copy data in buffer without consuming it
+ * @buffer:             pointer to buffer to read
+ * @to:                 iterator over memory that receives read data
+ * @skip:               bytes to pass before copying
+ * @len:                bytes number to be copied
+ * 
+ * Returns number of bytes copied.
+ */
+int peek_dynamic_buffer(dynamic_buffer_t *buffer, struct iov_iter *to, int skip, int len)
+{
+        return walk_dynamic_buffer(buffer, to, skip, len, true);
+}
+
+/**
+ * discard_dynamic_buffer - consume data in buffer without copying it
+ * @buffer:             pointer to buffer to edit
+ * @len:                bytes number to be dropped
+ * 
+ * Returns number of bytes dropped.
+ */
+int discard_dynamic_buffer(dynamic_buffer_t *buffer, int len)
+{
+        return walk_dynamic_buffer(buffer, NULL, 0, len, false);
+}
+
+/**
+ * head_run - bytes of the first write of buffer with data
+ * @buffer:     pointer to buffer to read
+ * @stamp:      filled with the stamp of the write, 0 if not stamped
+ * 
+ * In a data segment that coalesces stamped writes the run stops at the
+ * mark of the next write. The caller holds head_mutex.
+ * 
+ * Returns number of bytes that can be read from the write, 0 if buffer
+ * is empty.
+ */
+int head_run(dynamic_buffer_t *buffer, u64 *stamp)
+{
+        int i;
+        int end;
+        int nr_stamps;
+        segment_stamps_t *stamps;
         data_segment_t *cur_seg;
+
+        cur_seg = head_segment(buffer);
+        if (!cur_seg)
+                return 0;
+
+        end = smp_load_acquire(&(cur_seg->size));
+        stamps = cur_seg->stamps;
+        nr_stamps = stamps ? smp_load_acquire(&(stamps->count)) : 0;
+        *stamp = 0;
+
+        // the last write that starts before the next byte to read holds it
+        for (i = 0; i < nr_stamps; i++) {
+                if (stamps->marks[i] > cur_seg->byte_read) {
+                        end = min(end, stamps->marks[i]);
+                        break;
+                }
+                *stamp = stamps->stamps[i];
+        }
+
+        return end - cur_seg->byte_read;
+}
+
+/**
+ * splice_dynamic_buffer - move data in buffer to a pipe
+ * @buffer:     pointer to buffer to read
+ * @pipe:       pipe that receives data
+ * @len:        bytes number to be moved
+ * 
+ * Every chunk run becomes a pipe buffer that holds a reference to the
+ * page of the chunk, so data is never copied. The caller holds
+ * head_mutex and the pipe lock.
+ * 
+ * Returns number of bytes moved, a negative value if none could be
+ * moved because the pipe is full or has no readers.
+ */
+int splice_dynamic_buffer(dynamic_buffer_t *buffer, struct pipe_inode_info *pipe, int len)
+{
+        int to_read;
+        int byte_read;
+        ssize_t ret;
+        data_segment_t *cur_seg;
+        struct pipe_buffer buf;
+
+        byte_read = 0;
+        ret = 0;
+
+        // pairs with the barrier of add_byte_in_buffer
+        smp_rmb();
+
+        while (byte_read < len && (cur_seg = head_segment(buffer))) {
+                to_read = min(len - byte_read, smp_load_acquire(&(cur_seg->size)) - cur_seg->byte_read);
+
+                buf = (struct pipe_buffer) {
+                        .page = virt_to_page(cur_seg->content),
+                        .offset = cur_seg->byte_read,
+                        .len = to_read,
+                        .ops = &chunk_pipe_buf_ops
+                };
+
+                get_page(buf.page);
+
+                // on failure the reference is dropped by add_to_pipe
+                ret = add_to_pipe(pipe, &buf);
+                if (ret < 0)
+                        break;
+
+                cur_seg->byte_read += to_read;
+                byte_read += to_read;
+        }
+
+        return byte_read ? byte_read : ret;
+}
+
+/**
+ * attach_cursor - add the cursor of a reader to a broadcast buffer
+ * @buffer:     pointer to buffer
+ * @cursor:     cursor to add, it starts after the last byte written
+ * 
+ * The caller holds tail_mutex and head_mutex.
+ */
+void attach_cursor(dynamic_buffer_t *buffer, cursor_t *cursor)
+{
+        cursor->segment = buffer->tail;
+        cursor->offset = buffer->tail->size;
+        cursor->position = buffer->written;
+        cursor->overrun = false;
+
+        cursor->segment->refs++;
+        list_add_tail(&(cursor->node), &(buffer->cursors));
+}
+
+/**
+ * detach_cursor - remove the cursor of a reader from a broadcast buffer
+ * @buffer:     pointer to buffer
+ * @cursor:     cursor to remove
+ * 
+ * The caller holds head_mutex and then calls trim_cursors to free the
+ * data segments the cursor kept.
+ */
+void detach_cursor(dynamic_buffer_t *buffer, cursor_t *cursor)
+{
+        cursor->segment->refs--;
+        list_del(&(cursor->node));
+}
+
+/**
+ * advance_cursor - move a cursor on the next data segment
+ * @cursor:     cursor at the end of its data segment
+ * 
+ * Returns 1 if the cursor moved, 0 if its data segment is the tail.
+ */
+static int advance_cursor(cursor_t *cursor)
+{
+        data_segment_t *next_seg;
+
+        next_seg = smp_load_acquire(&(cursor->segment->next));
+        if (!next_seg)
+                return 0;
+
+        next_seg->refs++;
+        cursor->segment->refs--;
+        cursor->segment = next_seg;
+        cursor->offset = 0;
+
+        return 1;
+}
+
+/**
+ * read_cursor - copy data of a broadcast buffer from the cursor of a reader
+ * @buffer:     pointer to buffer to read
+ * @cursor:     cursor of the reader
+ * @to:         iterator over user memory that receives read data
+ * @len:        number of bytes to read
+ * 
+ * Data segments are shared by all the cursors and are not consumed, so
+ * every reader copies straight from the chunks written once. The caller
+ * holds head_mutex and then calls trim_cursors.
+ * 
+ * Returns number of bytes read.
+ */
+int read_cursor(dynamic_buffer_t *buffer, cursor_t *cursor, struct iov_iter *to, int len)
+{
+        int to_read;
+        int copied;
         int byte_read;
+        data_segment_t *cur_seg;
 
-        head = &(buffer->head);
-        cur = (head)->next;
-        cur_seg = list_entry(cur, struct data_segment, list);
         byte_read = 0;
 
-        while (len - byte_read >= cur_seg->size - cur_seg->byte_read) {
-                memcpy(read_content + byte_read, cur_seg->content + cur_seg->byte_read, cur_seg->size - cur_seg->byte_read);
-                byte_read += cur_seg->size - cur_seg->byte_read;
+        pagefault_disable();
+
+        while (byte_read < len) {
+                cur_seg = cursor->segment;
+                to_read = min(len - byte_read, smp_load_acquire(&(cur_seg->size)) - cursor->offset);
 
-                old = cur;
-                cur = cur->next;
-                free_data_segment(cur_seg);
-                list_del(old);
-                
-                if (cur == head)
+                if (to_read == 0) {
+                        if (!advance_cursor(cursor))
+                                break;
+                        continue;
+                }
+
+                copied = copy_to_iter(cur_seg->content + cursor->offset, to_read, to);
+
+                cursor->offset += copied;
+                byte_read += copied;
+
+                if (copied < to_read)
                         break;
-                cur_seg = list_entry(cur, struct data_segment, list);
         }
-        
-        // check if i must read in this condition: byte_to_read < cur->size
-        if (cur != head) {
-                cur_seg = list_entry(cur, struct data_segment, list);
 
-                memcpy(read_content + byte_read, cur_seg->content + cur_seg->byte_read, len - byte_read);
+        pagefault_enable();
+
+        WRITE_ONCE(cursor->position, cursor->position + byte_read);
+
+        return byte_read;
+}
+
+/**
+ * trim_cursors - free the data segments passed by all cursors of a buffer
+ * @buffer:     pointer to broadcast buffer
+ * 
+ * Cursors that lag more than the lag limit of buffer are moved on
+ * first, without copying, and marked as overrun. Data segments are freed
+ * from the head as long as no cursor is on them. Cursors never move
+ * byte_read, so the bytes of a data segment consumed before broadcast
+ * mode was selected are not counted again. The caller holds head_mutex.
+ * 
+ * Returns number of bytes freed.
+ */
+long trim_cursors(dynamic_buffer_t *buffer)
+{
+        int skip;
+        long lag;
+        long freed;
+        long written;
+        cursor_t *cursor;
+        data_segment_t *cur_seg;
+        data_segment_t *next_seg;
+
+        freed = 0;
+        written = smp_load_acquire(&(buffer->written));
+
+        if (buffer->lag_limit) {
+                list_for_each_entry(cursor, &(buffer->cursors), node) {
+                        while ((lag = written - cursor->position) > buffer->lag_limit) {
+                                skip = min_t(long, lag - buffer->lag_limit,
+                                        smp_load_acquire(&(cursor->segment->size)) - cursor->offset);
+
+                                if (skip == 0) {
+                                        if (!advance_cursor(cursor))
+                                                break;
+                                        continue;
+                                }
 
-                cur_seg->byte_read += len - byte_read;
-                byte_read += len - byte_read;
+                                cursor->offset += skip;
+                                WRITE_ONCE(cursor->position, cursor->position + skip);
+                                cursor->overrun = true;
+                        }
+                }
         }
+
+        for (;;) {
+                cur_seg = buffer->head;
+                next_seg = smp_load_acquire(&(cur_seg->next));
+
+                if (cur_seg->refs || !next_seg)
+                        break;
+
+                buffer->head = next_seg;
+                freed += cur_seg->size - cur_seg->byte_read;
+                free_data_segment(buffer->pool, cur_seg);
+        }
+
+        return freed;
 }
 
 /**
  * free_data_segment - free a data segment
+ * @pool:       pointer to pool of chunks
  * @segment:    pointer to data segment to free
  */
-void free_data_segment(data_segment_t *segment)
+void free_data_segment(chunk_pool_t *pool, data_segment_t *segment)
 {
-        kfree(segment->content);
-        kfree(segment);
+        if (segment->content)
+                put_chunk(pool, segment->content);
+
+        if (segment->stamps)
+                kmem_cache_free(stamps_cache, segment->stamps);
+
+        kmem_cache_free(segment_cache, segment);
 
         return;
 }
+/**
+ * free_data_segments - free a list of data segments
+ * @pool:       pointer to pool of chunks
+ * @segments:   list of data segments to free
+ */
+void free_data_segments(chunk_pool_t *pool, struct list_head *segments)
+{
+        data_segment_t *cur_seg;
+        data_segment_t *next_seg;
+
+        list_for_each_entry_safe(cur_seg, next_seg, segments, list) {
+                list_del(&(cur_seg->list));
+                free_data_segment(pool, cur_seg);
+        }
+}
 
 /**
  * free_dynamic_buffer - free a buffer
@@ -118,26 +981,18 @@ void free_data_segment(data_segment_t *segment)
  */
 void free_dynamic_buffer(dynamic_buffer_t *buffer)
 { 
-        struct list_head *cur;
-        struct list_head *old;
-        struct list_head *head;
         data_segment_t *cur_seg;
+        data_segment_t *next_seg;
 
-        head = &(buffer->head);
-        old = NULL;
-
-        list_for_each(cur, head) {
-                if (old)
-                        list_del(old);
-                cur_seg = list_entry(cur, data_segment_t, list);
-
-                free_data_segment(cur_seg);
-                old = cur;
+        for (cur_seg = buffer->head; cur_seg; cur_seg = next_seg) {
+                next_seg = cur_seg->next;
+                free_data_segment(buffer->pool, cur_seg);
         }
 
-        mutex_destroy(&(buffer->op_mutex));
+        mutex_destroy(&(buffer->head_mutex));
+        mutex_destroy(&(buffer->tail_mutex));
 
-        kfree(buffer);
+        kmem_cache_free(buffer_cache, buffer);
 
         return;
 }
\ No newline at end of file
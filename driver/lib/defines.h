@@ -5,23 +5,87 @@
 
 #define MODNAME "CHAR DEV"
 #define DEVICE_NAME "multi-flow device"
+#define CLASS_NAME "multi-flow"                         // class of device nodes
+#define NODE_NAME "multi-flow-%d"                       // name of device nodes, one per minor
+#define CONTROL_NODE_NAME "multi-flow-ctl"              // name of control node, with minor number minors
 
 /* CONSTANTS DEFINITION */
 
 /* general information */
 #define MAX_BYTE_IN_BUFFER 32*4096                      // maximum number of byte in buffer
-#define MINOR_NUMBER 128                                // maximum number of minor manageable
-#define FLOWS 2                                         // number of different priority
+#define MINOR_NUMBER 128                                // default number of minor manageable
+#define MAX_MINOR_NUMBER (1 << MINORBITS)               // maximum number of minor manageable
+#define MAX_ENABLED_MINORS (PAGE_SIZE / 2 - 1)          // maximum number of minor whose enabled flags fit in one page
+#define FLOWS 2                                         // default number of different priority
+#define MAX_FLOWS 8                                     // maximum number of different priority
+#define MAX_FLOW_CAPACITY (32*MAX_BYTE_IN_BUFFER)       // maximum capacity of a flow
 
 #define LOW_PRIORITY 0                                  // index assigned to low priority
 #define HIGH_PRIORITY 1                                 // index assigned to high priority
 
+/* memory management */
+#define CHUNK_SIZE PAGE_SIZE                            // size of a pooled payload chunk
+#define CHUNK_POOL_SIZE 32                              // maximum number of recycled chunks per minor
+#define SEGMENT_STAMPS 4                                // maximum number of stamped writes coalesced in a chunk
+
+/* deferred writes */
+#define FLUSH_BYTES             (MAX_BYTE_IN_BUFFER / 4)        // default staged bytes that start a flush
+#define FLUSH_DELAY_MS          1                               // default delay of a flush in milliseconds
+
 /* ioctl indexes */
 #define TO_HIGH_PRIORITY        3                       
 #define TO_LOW_PRIORITY         4
 #define BLOCK                   5
 #define UNBLOCK                 6
 #define TIMEOUT                 7
+#define RING_MODE               8
+#define RING_NOTIFY             9
+#define READ_LOWAT              10
+#define WRITE_LOWAT             11
+#define TIMEOUT_USEC            12
+#define TIMEOUT_NSEC            13
+#define DEADLINE                14
+#define BUSY_POLL               15
+#define SHARDED_MODE            16
+#define UNIFIED_READ            17
+#define SET_PRIORITY            18
+#define BROADCAST_MODE          19
+#define PEEK                    20
+#define DISCARD                 21
+#define RECORD_MODE             22
+#define READ_RECORDS            23
+#define SUBMIT                  24
+#define GROUP_JOIN              25
+#define GROUP_SOURCE            26
+#define DRAIN                   27
+
+/* record mode */
+#define RECORD_HEADER_SIZE      sizeof(u32)             // length word in front of every record
+#define RECORD_BATCH_MAX        64                      // maximum number of records of a batched read
+
+/* batched submission */
+#define SUBMIT_BATCH_MAX        64                      // maximum number of writes of a batch
+
+/* group sessions */
+#define GROUP_MAX_MEMBERS       128                     // maximum number of minors read by a session
+#define MAX_GROUP_WEIGHT        255                     // maximum reads served in a row to a minor
+
+/* unified reads of both flows */
+#define MAX_READ_WEIGHT         255                     // maximum weight of high priority flow
+
+/* sharded mode of high priority flow */
+#define SHARD_BY_WRITER         1                       // shard picked by writer, per-writer order
+#define SHARD_BY_CPU            2                       // shard picked by CPU, order of write time
+
+/* busy-poll of blocking readers */
+#define MAX_BUSY_POLL_USEC      10000                   // maximum busy-poll budget in microseconds
+#define MIN_BUSY_POLL_NSEC      1000                    // floor of the adaptive budget in nanoseconds
+
+/* shared ring of high priority flow */
+#define RING_HEADER_SIZE        PAGE_SIZE                       // size of header page
+#define RING_DATA_SIZE          MAX_BYTE_IN_BUFFER              // size of data area, power of two
+#define RING_AREA_SIZE          (RING_HEADER_SIZE + RING_DATA_SIZE)
+#define RING_FIELD_ALIGN        64                              // alignment of header fields
 
 /* upper and lower bound for seconds */
 #define MIN_SECONDS             1                       // minimum amount of seconds
@@ -29,77 +93,394 @@
 
 /* STRUCTURES DEFINITION */
 
+/*
+ * chunk_pool_t - pool of recycled payload chunks
+ * @free_list:  list of free chunks, linked through their own content
+ * @lock:       spinlock to synchronize pool operations
+ * @count:      number of chunks in pool
+ */
+typedef struct chunk_pool {
+        struct list_head free_list;
+        spinlock_t lock;
+        int count;
+} chunk_pool_t;
+
+/*
+ * segment_stamps_t - stamped writes of a data segment of a sharded flow
+ * @stamps:     time of the stamped writes coalesced in the data segment
+ * @marks:      offset of the first byte of each stamped write
+ * @count:      number of stamped writes, 0 until the data segment is filled
+ */
+typedef struct segment_stamps {
+        u64 stamps[SEGMENT_STAMPS];
+        int marks[SEGMENT_STAMPS];
+        int count;
+} segment_stamps_t;
+
 /*
  * data_segment_t - data segment
- * @list:       list_head element to link to list
- * @content:    byte content of data segment
+ * @list:       list_head element to link to staging list
+ * @next:       next data segment in buffer queue
+ * @stamps:     stamped writes, NULL if the data segment is not stamped
+ * @content:    chunk of CHUNK_SIZE bytes that holds data segment content
  * @byte_read:  number of byte read up to instant t
- * @size:       size of data segment content
+ * @size:       number of bytes written in the chunk
+ * @refs:       number of broadcast cursors on the data segment
+ * @shared:     true if the chunk is referenced by data segments of other buffers
  */
 typedef struct data_segment {
         struct list_head list;
+        struct data_segment *next;
+        segment_stamps_t *stamps;
         char *content;
         int byte_read;
         int size;
+        int refs;
+        bool shared;
 } data_segment_t;
 
 /*
- * dynamic_buffer_t - buffer
- * @head:       head of linked list
- * @op_mutex:   mutex to synchronize operation in buffer
- * @waitqueue:  waitqueue
+ * cursor_t - position of a reader in a broadcast flow
+ * @node:       element of the cursors list of buffer
+ * @segment:    data segment holding the next byte to read
+ * @offset:     offset of the next byte to read in @segment
+ * @position:   number of bytes of the flow passed by the reader
+ * @priority:   priority of the flow
+ * @overrun:    true if bytes were skipped because the reader lagged too much
+ */
+typedef struct cursor {
+        struct list_head node;
+        data_segment_t *segment;
+        int offset;
+        long position;
+        short priority;
+        bool overrun;
+} cursor_t;
+
+/*
+ * dynamic_buffer_t - buffer of a flow
+ * @pool:               pool of chunks used for data segment content
+ * @capacity:           maximum number of bytes in buffer
+ * @deferred:           true if writes are staged and flushed by a work item
+ * @broadcast:          true if every reader has its own cursor on the data
+ * @lag_limit:          bytes a cursor can lag before it is moved on, 0 if no limit
+ * @head:               first data segment of queue, owned by consumers
+ * @head_mutex:         mutex to synchronize read operations in buffer
+ * @cursors:            cursors of the readers of a broadcast flow
+ * @tail:               last data segment of queue, owned by producers
+ * @tail_mutex:         mutex to synchronize write operations in buffer
+ * @byte_in_buffer:     number of bytes in buffer
+ * @booked_byte:        number of bytes booked by deferred writes or by writers of shards
+ * @written:            number of bytes ever written in a broadcast flow
+ * @thread_in_wait:     number of threads waiting on the flow
+ * @readers:            waitqueue of readers waiting for data
+ * @writers:            waitqueue of writers waiting for free space
+ * 
+ * Buffers are allocated from a cache aligned to cache lines. The read
+ * mostly pool pointer and policy, the consumer side, the producer side and the
+ * counters with waitqueues each live in their own cache line, so readers
+ * and writers of the same flow, and different flows, never share one.
  */
 typedef struct dynamic_buffer {
-        struct list_head head;
-        struct mutex op_mutex;
-        wait_queue_head_t waitqueue;
+        chunk_pool_t *pool;
+        long capacity;
+        bool deferred;
+        bool broadcast;
+        long lag_limit;
+        data_segment_t *head ____cacheline_aligned_in_smp;
+        struct mutex head_mutex;
+        struct list_head cursors;
+        data_segment_t *tail ____cacheline_aligned_in_smp;
+        struct mutex tail_mutex;
+        atomic_long_t byte_in_buffer ____cacheline_aligned_in_smp;
+        atomic_long_t booked_byte;
+        long written;
+        atomic_long_t thread_in_wait;
+        wait_queue_head_t readers;
+        wait_queue_head_t writers;
 } dynamic_buffer_t;
 
 /*
- * object_t - I/O object
- * @workqueue:  pointer to workqueue for low priority flow
- * @buffer:     two buffer, low and high priority
+ * ring_header_t - header page of shared ring, mapped in user space
+ * @producer:           free running index of next byte to write
+ * @consumer:           free running index of next byte to read
+ * @size:               size of data area
+ * @reader_waiting:     number of consumers sleeping on empty ring
+ * @writer_waiting:     number of producers sleeping on full ring
+ * 
+ * Producer and consumer live in different cache lines, the layout is
+ * part of the user space interface. The waiting counters are updated
+ * with atomic operations by both user space and kernel waiters, and a
+ * side that moves an index notifies the other one only if its counter
+ * is not zero.
+ */
+typedef struct ring_header {
+        unsigned int producer __attribute__((aligned(RING_FIELD_ALIGN)));
+        unsigned int consumer __attribute__((aligned(RING_FIELD_ALIGN)));
+        unsigned int size __attribute__((aligned(RING_FIELD_ALIGN)));
+        unsigned int reader_waiting;
+        unsigned int writer_waiting;
+} ring_header_t;
+
+/*
+ * ring_t - shared ring
+ * @area:       vmalloc'd area, header page followed by data area
+ * @header:     header page
+ * @data:       data area
+ */
+typedef struct ring {
+        void *area;
+        ring_header_t *header;
+        char *data;
+} ring_t;
+
+/*
+ * object_t - I/O object, allocated by the first session of its minor
+ * @minor:              minor of device
+ * @buffer:             one buffer per flow, from low to high priority
+ * @ring:               shared ring of high priority flow, NULL if not in ring mode
+ * @shards:             sub-queues of high priority flow, NULL if not in sharded mode
+ * @nr_shards:          number of sub-queues
+ * @ordered:            true if sub-queues are merged in order of write time
+ * @next_shard:         sub-queue read first by next reader in writer mode
+ * @record:             true if every write is a record read whole
+ * @sessions:           number of open sessions and running submissions, protected by devices_mutex
+ * @staged:             lock-free list of writes to deferred flows waiting for flush
+ * @staged_byte:        number of bytes in @staged
+ * @flush_work:         the only work item that moves @staged into buffer
+ * @pool:               chunk pool shared by all buffer
+ * 
+ * Objects are allocated from a cache aligned to cache lines. Read mostly
+ * fields come first, the staging area written by writers of deferred
+ * flows and the pool written by every flow have their own cache lines. The
+ * counters of each flow live in its buffer.
+ * 
+ * A work item never runs concurrently with itself, so the flushes of a
+ * minor are serialized even on the shared workqueue.
  */
 typedef struct object {
-        struct workqueue_struct *workqueue;
-        dynamic_buffer_t *buffer[FLOWS];
+        int minor;
+        dynamic_buffer_t *buffer[MAX_FLOWS];
+        ring_t *ring;
+        dynamic_buffer_t **shards;
+        int nr_shards;
+        bool ordered;
+        int next_shard;
+        bool record;
+        int sessions;
+        struct llist_head staged ____cacheline_aligned_in_smp;
+        atomic_long_t staged_byte;
+        struct delayed_work flush_work;
+        chunk_pool_t pool ____cacheline_aligned_in_smp;
 } object_t;
 
 /*
  * session_t - I/O session
+ * @object:     I/O object of the minor
  * @priority:   priority of session
  * @flags:      flags used for allocation (blocking or not)
  * @timeout:    timeout for blocking operations
+ * @deadline:   absolute CLOCK_MONOTONIC deadline of next blocking operation, 0 if none
+ * @read_lowat: bytes to read that wake a blocking reader
+ * @write_lowat:        free bytes that wake a blocking writer, 0 for the whole write
+ * @busy_poll_max:      busy-poll budget set by the user in nanoseconds, 0 if disabled
+ * @busy_poll_cur:      adaptive busy-poll budget in nanoseconds
+ * @weight:     high priority bytes read per low priority byte, 0 if reads use only @priority
+ * @low_credit: bytes read since the last share of low priority flow, times its weight
+ * @cursor:     cursor of the session on a broadcast flow, NULL if none
+ * @peek:       true if the next read that returns data leaves it in the flow
+ * @group:      minors read by the session, NULL if reads use only @object
  */
 typedef struct session {
+        object_t *object;
         short priority;
         gfp_t flags;
-        unsigned long timeout;
+        ktime_t timeout;
+        ktime_t deadline;
+        long read_lowat;
+        long write_lowat;
+        u64 busy_poll_max;
+        u64 busy_poll_cur;
+        int weight;
+        long low_credit;
+        cursor_t *cursor;
+        bool peek;
+        struct group *group;
 } session_t;
 
 /*
- * packed_work_t - delayed work
- * @staging_area:       byte to write
- * @minor:              minor of device
- * @the_work:           work struct
+ * group_member_t - minor read by a group session
+ * @entry:      entry of the readers waitqueue of the flow of the minor
+ * @object:     I/O object of the minor
+ * @group:      group of the member
+ * @weight:     reads served in a row to the minor while it has data
+ */
+typedef struct group_member {
+        struct wait_queue_entry entry;
+        object_t *object;
+        struct group *group;
+        int weight;
+} group_member_t;
+
+/*
+ * group_t - minors read by a group session
+ * @mutex:      mutex to serialize the reads of the session
+ * @priority:   flow read on every minor by the current read
+ * @count:      number of members
+ * @next:       member read first by the next read
+ * @turns:      reads left to @next before the next member gets its turn
+ * @last:       minor of the last read, -1 if none
+ * @members:    members, the minor of the session first
+ */
+typedef struct group {
+        struct mutex mutex;
+        short priority;
+        int count;
+        int next;
+        int turns;
+        int last;
+        group_member_t members[GROUP_MAX_MEMBERS];
+} group_t;
+
+/*
+ * group_join_t - argument of GROUP_JOIN
+ * @minor:      minor to read
+ * @weight:     reads served in a row to the minor, from 1 to MAX_GROUP_WEIGHT
+ */
+typedef struct group_join {
+        unsigned int minor;
+        unsigned int weight;
+} group_join_t;
+
+/*
+ * flow_waiter_t - thread waiting on a flow
+ * @entry:      entry of the readers or writers waitqueue
+ * @object:     I/O object of the minor
+ * @priority:   priority of the flow
+ * @writer:     true if the thread waits for free space, false for data
+ * @need:       bytes of free space or data that wake the thread
+ * @both:       true if a reader waits for data of both flows
+ * @low_entry:  entry of the readers waitqueue of low priority flow, if @both
+ * @cursor:     cursor of a reader of a broadcast flow, NULL if none
+ */
+typedef struct flow_waiter {
+        struct wait_queue_entry entry;
+        struct object *object;
+        short priority;
+        bool writer;
+        long need;
+        bool both;
+        struct wait_queue_entry low_entry;
+        cursor_t *cursor;
+} flow_waiter_t;
+
+/*
+ * packed_work_t - write to a deferred flow waiting for flush
+ * @node:               llist_node element to link to staged list of object
+ * @staging_area:       list of data segments to write
+ * @size:               number of bytes staged
+ * @priority:           priority of the flow
  */
 typedef struct packed_work{
-        data_segment_t *staging_area;
-        int minor;
-        struct work_struct the_work;
+        struct llist_node node;
+        struct list_head staging_area;
+        int size;
+        short priority;
 } packed_work_t;
 
+/*
+ * record_batch_t - argument of READ_RECORDS
+ * @buffer:     user area that receives the records back to back
+ * @size:       size of @buffer
+ * @lengths:    user array that receives the length of every record
+ * @count:      maximum number of records, on return the records read
+ */
+typedef struct record_batch {
+        void __user *buffer;
+        unsigned long size;
+        unsigned int __user *lengths;
+        unsigned int count;
+} record_batch_t;
+
+/*
+ * submit_entry_t - write of a SUBMIT batch
+ * @minor:      minor to write
+ * @flow:       flow of the minor to write
+ * @iov:        user vectors of payload, entries with the same vectors share it
+ * @iovcnt:     number of vectors
+ */
+typedef struct submit_entry {
+        unsigned int minor;
+        unsigned int flow;
+        const struct iovec __user *iov;
+        unsigned int iovcnt;
+} submit_entry_t;
+
+/*
+ * submit_batch_t - argument of SUBMIT
+ * @entries:    user array of writes
+ * @results:    user array that receives written bytes or an error of every write
+ * @count:      number of writes
+ */
+typedef struct submit_batch {
+        const submit_entry_t __user *entries;
+        long __user *results;
+        unsigned int count;
+} submit_batch_t;
+
+/*
+ * submit_payload_t - payload of SUBMIT entries, copied from user once
+ * @segments:   list of data segments that hold the payload
+ * @size:       bytes of payload, otherwise the error of its copy
+ */
+typedef struct submit_payload {
+        struct list_head segments;
+        long size;
+} submit_payload_t;
+
 /* dynamic buffer functions prototypes */
-void    init_dynamic_buffer(dynamic_buffer_t *);
-void    init_data_segment(data_segment_t *, char *, int);
-void    write_dynamic_buffer(dynamic_buffer_t *, data_segment_t *);
-void    read_dynamic_buffer(dynamic_buffer_t *, char *, int);
-void    free_data_segment(data_segment_t *);
-void    free_dynamic_buffer(dynamic_buffer_t *);
+int             init_buffer_caches(void);
+void            destroy_buffer_caches(void);
+void            init_chunk_pool(chunk_pool_t *);
+void            free_chunk_pool(chunk_pool_t *);
+dynamic_buffer_t *alloc_dynamic_buffer(chunk_pool_t *);
+void            init_data_segment(data_segment_t *, char *, int);
+int             alloc_data_segments(chunk_pool_t *, struct list_head *, int, gfp_t);
+int             share_data_segments(chunk_pool_t *, struct list_head *, struct list_head *, gfp_t);
+int             stamp_data_segments(struct list_head *, gfp_t);
+void            put_record_header(struct list_head *, u32);
+int             copy_segments_from_iter(struct list_head *, struct iov_iter *, int);
+void            trim_data_segments(chunk_pool_t *, struct list_head *, int);
+void            write_dynamic_buffer(dynamic_buffer_t *, struct list_head *);
+int             copy_to_dynamic_buffer(dynamic_buffer_t *, struct list_head *, struct iov_iter *, int, u64);
+int             read_dynamic_buffer(dynamic_buffer_t *, struct iov_iter *, int);
+int             peek_dynamic_buffer(dynamic_buffer_t *, struct iov_iter *, int, int);
+int             discard_dynamic_buffer(dynamic_buffer_t *, int);
+int             head_run(dynamic_buffer_t *, u64 *);
+void            attach_cursor(dynamic_buffer_t *, cursor_t *);
+void            detach_cursor(dynamic_buffer_t *, cursor_t *);
+int             read_cursor(dynamic_buffer_t *, cursor_t *, struct iov_iter *, int);
+long            trim_cursors(dynamic_buffer_t *);
+int             splice_dynamic_buffer(dynamic_buffer_t *, struct pipe_inode_info *, int);
+void            free_data_segment(chunk_pool_t *, data_segment_t *);
+void            free_data_segments(chunk_pool_t *, struct list_head *);
+void            free_dynamic_buffer(dynamic_buffer_t *);
+
+/* ring buffer functions prototypes */
+ring_t          *alloc_ring(void);
+int             ring_used(ring_t *);
+void            ring_mark_waiter(ring_t *, bool, int);
+int             write_ring(ring_t *, struct iov_iter *, int);
+int             read_ring(ring_t *, struct iov_iter *, int);
+int             mmap_ring(ring_t *, struct vm_area_struct *);
+void            free_ring(ring_t *);
 
 /* MACRO DEFINITION */
 #define get_seconds(sec)        (sec > MAX_SECONDS ? sec = MAX_SECONDS : (sec == 0 ? sec = MIN_SECONDS : sec))
 
+#define get_nanoseconds(nsec, unit)                                             \
+        ns_to_ktime(clamp_t(u64, nsec, 1, (u64)MAX_SECONDS * NSEC_PER_SEC / (unit)) * (unit))
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
 #define get_major(session)      MAJOR(session->f_inode->i_rdev)
 #define get_minor(session)      MINOR(session->f_inode->i_rdev)
@@ -108,117 +489,127 @@ void    free_dynamic_buffer(dynamic_buffer_t *);
 #define get_minor(session)      MINOR(session->f_dentry->d_inode->i_rdev)
 #endif
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
-#define personal_wait   wait_event_interruptible_exclusive_timeout      
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+#define prefault_readable(iter, len)    (fault_in_iov_iter_readable(iter, len) == (len))
+#define prefault_writeable(iter, len)   (fault_in_iov_iter_writeable(iter, len) == (len))
+#else
+#define prefault_readable(iter, len)    iov_iter_fault_in_readable(iter, len)
+#define prefault_writeable(iter, len)                                           \
+        (iter_is_iovec(iter) ?                                                  \
+                fault_in_pages_writeable(                                       \
+                        (iter)->iov->iov_base + (iter)->iov_offset,             \
+                        min_t(size_t, len,                                      \
+                                (iter)->iov->iov_len - (iter)->iov_offset)) :   \
+                0)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+#define copy_splice_read        generic_file_splice_read
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+#define init_kvec_iter(iter, vec, len)  iov_iter_kvec(iter, READ, vec, 1, len)
+#else
+#define init_kvec_iter(iter, vec, len)  iov_iter_kvec(iter, ITER_KVEC | READ, vec, 1, len)
+#endif
+
+#define is_nowait(iocb)                                                         \
+        (iocb->ki_flags & IOCB_NOWAIT ? 1 : 0)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define create_device_class(name)       class_create(name)
 #else
-#define personal_wait   wait_event_interruptible_timeout
+#define create_device_class(name)       class_create(THIS_MODULE, name)
 #endif
 
-/* definition of macro to manage byte in buffer and indexes*/
-#define get_byte_in_buffer_index(priority, minor)                               \
-        ((priority * MINOR_NUMBER) + minor)
+/* definition of macro to manage byte in buffer of an object */
+#define is_ring_mode(priority,object)                                           \
+        (priority == HIGH_PRIORITY && (object)->ring)
+
+#define is_sharded(priority,object)                                             \
+        (priority == HIGH_PRIORITY && (object)->shards)
+
+#define byte_to_read(priority,object)                                           \
+        (is_ring_mode(priority,object) ?                                        \
+                ring_used((object)->ring) :                                     \
+                atomic_long_read(&((object)->buffer[priority]->byte_in_buffer)) \
+        )
+
+#define busy_space(priority,object)                                             \
+        (byte_to_read(priority,object) +                                        \
+                atomic_long_read(&((object)->buffer[priority]->booked_byte)))
+
+#define capacity(priority,object)                                               \
+        (is_ring_mode(priority,object) ?                                        \
+                RING_DATA_SIZE :                                                \
+                (object)->buffer[priority]->capacity                            \
+        )
 
-#define byte_to_read(priority,minor)                                            \
-        byte_in_buffer[get_byte_in_buffer_index(priority, minor)]
+#define free_space(priority,object)                                             \
+        (capacity(priority,object) - busy_space(priority,object))         
 
-#define busy_space(priority,minor)                                              \
-        (priority == LOW_PRIORITY ?                                             \
-        (                                                                       \
-                byte_in_buffer[get_byte_in_buffer_index(priority, minor)] +     \
-                        booked_byte[minor]) :                                   \
-                byte_in_buffer[get_byte_in_buffer_index(priority, minor)]       \
-        )                                                             
+#define is_there_space(priority,object)                                         \
+        (free_space(priority,object) > 0 ? 1 : 0)                            
 
-#define free_space(priority,minor)                                              \
-        MAX_BYTE_IN_BUFFER - busy_space(priority,minor)         
+#define byte_to_read_flows(object)                                              \
+        (byte_to_read(HIGH_PRIORITY,object) + byte_to_read(LOW_PRIORITY,object))
 
-#define is_there_space(priority,minor)                                          \
-        (free_space(priority,minor) == 0 ? 0 : 1)                            
+#define is_plain(priority,object)                                               \
+        (!is_ring_mode(priority,object) && !is_sharded(priority,object) &&     \
+                !(object)->buffer[priority]->broadcast)
 
-#define is_empty(priority,minor)                                                \
-        (byte_to_read(priority,minor) == 0 ? 1 : 0)    
+#define is_empty(priority,object)                                               \
+        (byte_to_read(priority,object) == 0 ? 1 : 0)    
+
+#define is_full(priority,object)                                                \
+        (is_there_space(priority,object) ? 0 : 1)
 
 #define is_blocking(flags)                                                      \
         (flags == GFP_ATOMIC ? 0 : 1)
 
-#define add_byte_in_buffer(priority,minor,len)                                  \
-        byte_in_buffer[get_byte_in_buffer_index(priority,minor)] += len
+/*
+ * Producers and consumers of a flow update the counters under different
+ * mutexes. Data is published before the counter grows, so a consumer
+ * that sees the bytes also sees the data segments holding them.
+ */
+#define add_byte_in_buffer(priority,object,len)                                 \
+do {                                                                            \
+        smp_mb__before_atomic();                                                \
+        atomic_long_add(len, &((object)->buffer[priority]->byte_in_buffer));    \
+} while (0)
 
-#define add_booked_byte(minor,len)                                              \
-        booked_byte[minor] += len
+#define add_booked_byte(priority,object,len)                                    \
+        atomic_long_add(len, &((object)->buffer[priority]->booked_byte))
 
-#define sub_byte_in_buffer(priority,minor,len)                                  \
-        byte_in_buffer[get_byte_in_buffer_index(priority,minor)] -= len
+#define sub_byte_in_buffer(priority,object,len)                                 \
+        atomic_long_sub(len, &((object)->buffer[priority]->byte_in_buffer))
 
-#define sub_booked_byte(minor,len)                                              \
-        booked_byte[minor] -= len
+#define sub_booked_byte(priority,object,len)                                    \
+        atomic_long_sub(len, &((object)->buffer[priority]->booked_byte))
         
-#define atomic_inc_thread_in_wait(priority,minor)                               \
-        __sync_fetch_and_add(                                                   \
-                thread_in_wait + get_byte_in_buffer_index(priority,minor),      \
-                1)
+#define atomic_inc_thread_in_wait(priority,object)                              \
+        atomic_long_inc(&((object)->buffer[priority]->thread_in_wait))
 
-#define atomic_dec_thread_in_wait(priority,minor)                               \
-        __sync_fetch_and_sub(                                                   \
-                thread_in_wait + get_byte_in_buffer_index(priority,minor),      \
-                1)
+#define atomic_dec_thread_in_wait(priority,object)                              \
+        atomic_long_dec(&((object)->buffer[priority]->thread_in_wait))
 
 /*
- * lock_and_awake
- *
- * This macro return a value of condition evaluated in the macro
- * wait_event_interruptible_exclusive_timeout.
- * 
- * @condition:  condition to evaluate
- * @mutex:      pointer to mutex to try lock
- */
-#define lock_and_awake(condition, mutex)                                        \
-({                                                                              \
-        int __ret = 0;                                                          \
-        if (mutex_trylock(mutex)) {                                             \
-                if (condition)                                                  \
-                        __ret = 1;                                              \
-                else                                                            \
-                        mutex_unlock(mutex);                                    \
-        }                                                                       \
-        __ret;                                                                  \
-})
-
-/*
- * __wait_event_interruptible_exclusive_timeout
- *
- * This macro allow to put in waitqueue a task in exclusive mode and
- * set a timeout.
- * 
- * @wq_head:    head of waitqueue
- * @condition:  awakeness condition
- * @timeout:    awakeness timeout
+ * Readers and writers sleep on different waitqueues. A waker wakes at
+ * most one blocking waiter whose need is met, poll waiters always.
  */
-#define __wait_event_interruptible_exclusive_timeout(wq_head,condition,timeout) \
-	___wait_event(wq_head, ___wait_cond_timeout(condition),			\
-		      TASK_INTERRUPTIBLE, 1, timeout,				\
-		      __ret = schedule_timeout(__ret))
+#define wake_up_readers(buffer)                                                 \
+        wake_up_interruptible_poll(&((buffer)->readers), EPOLLIN | EPOLLRDNORM)
 
+#define wake_up_all_readers(buffer)                                             \
+        wake_up_interruptible_all(&((buffer)->readers))
 
-/*
- * wait_event_interruptible_exclusive_timeout
- *
- * This macro is a change of wait_event_interruptible_timeout because
- * call __wait_event_interruptible_exclusive_timeout instead of the
- * macro __wait_event_interruptible_timeout.
- * 
- * @wq_head:    head of waitqueue
- * @condition:  awakeness condition
- * @timeout:    awakeness timeout
- */
-#define wait_event_interruptible_exclusive_timeout(wq_head,condition,timeout)   \
-({										\
-	long __ret = timeout;							\
-	might_sleep();								\
-	if (!___wait_cond_timeout(condition))					\
-		__ret = __wait_event_interruptible_exclusive_timeout(wq_head,	\
-						condition, timeout);		\
-	__ret;									\
-})
+#define has_cursor(session)                                                     \
+        ((session)->cursor && (session)->cursor->priority == (session)->priority)
+
+#define cursor_to_read(buffer,cursor)                                           \
+        (smp_load_acquire(&((buffer)->written)) - READ_ONCE((cursor)->position))
+
+#define wake_up_writers(buffer)                                                 \
+        wake_up_interruptible_poll(&((buffer)->writers), EPOLLOUT | EPOLLWRNORM)
 
 #endif
@@ -1,90 +1,444 @@
 /*  
  * @file multi-flow-dev.c
- * @brief multi-flow device driver with 128 minor numbers
+ * @brief multi-flow device driver with a load time number of minors
  */
 
 #define EXPORT_SYMTAB
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/device.h>
 #include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
 #include <linux/pid.h>
+#include <linux/poll.h>
 #include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/splice.h>
+#include <linux/time64.h>
 #include <linux/tty.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
 #include <linux/workqueue.h>
 #include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/clock.h>
+#endif
 #include "lib/defines.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Alessandro Chillotti");
 
-/* module parameters */
-bool enabled[MINOR_NUMBER] = {[0 ... (MINOR_NUMBER-1)] = true}; 
-long byte_in_buffer[FLOWS * MINOR_NUMBER];
-long thread_in_wait[FLOWS * MINOR_NUMBER];
-module_param_array(enabled, bool, NULL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-module_param_array(byte_in_buffer, long, NULL, S_IRUSR | S_IRGRP);
-module_param_array(thread_in_wait, long, NULL, S_IRUSR | S_IRGRP);
-
 /* global variables */
 static int Major;
-object_t devices[MINOR_NUMBER];
-long booked_byte[MINOR_NUMBER] = {[0 ... (MINOR_NUMBER-1)] = 0};
+static struct kmem_cache *work_cache;
+static struct kmem_cache *object_cache;
+static struct workqueue_struct *flush_wq;
+static chunk_pool_t submit_pool;
+static struct class *device_class;
+static struct dentry *debug_dir;
+static DEFINE_MUTEX(devices_mutex);
+object_t **devices;
+bool *enabled;
+static char *enabled_at_load;
+
+/* module parameters functions prototypes */
+static int      parse_enabled(const char *);
+static int      enabled_set(const char *, const struct kernel_param *);
+static int      enabled_get(char *, const struct kernel_param *);
+static int      read_only_set(const char *, const struct kernel_param *);
+static int      byte_in_buffer_get(char *, const struct kernel_param *);
+static int      thread_in_wait_get(char *, const struct kernel_param *);
+
+/* per flow views functions prototypes */
+static long     byte_in_buffer_of(object_t *, int);
+static long     thread_in_wait_of(object_t *, int);
+static long     *snapshot_flows(long (*)(object_t *, int));
+static int      print_flows(char *, long (*)(object_t *, int));
+static int      render_flows(struct seq_file *, long (*)(object_t *, int));
+static int      byte_in_buffer_show(struct seq_file *, void *);
+static int      thread_in_wait_show(struct seq_file *, void *);
+static int      byte_in_buffer_open(struct inode *, struct file *);
+static int      thread_in_wait_open(struct inode *, struct file *);
+
+/* per minor views are rendered on access, minors without object are idle and empty */
+static const struct kernel_param_ops enabled_ops = {
+        .set = enabled_set,
+        .get = enabled_get
+};
+
+static const struct kernel_param_ops byte_in_buffer_ops = {
+        .set = read_only_set,
+        .get = byte_in_buffer_get
+};
+
+static const struct kernel_param_ops thread_in_wait_ops = {
+        .set = read_only_set,
+        .get = thread_in_wait_get
+};
+
+/* the same per flow views as debugfs files, that are not bound to one page */
+static const struct file_operations byte_in_buffer_fops = {
+        .owner = THIS_MODULE,
+        .open = byte_in_buffer_open,
+        .read = seq_read,
+        .llseek = seq_lseek,
+        .release = single_release
+};
+
+static const struct file_operations thread_in_wait_fops = {
+        .owner = THIS_MODULE,
+        .open = thread_in_wait_open,
+        .read = seq_read,
+        .llseek = seq_lseek,
+        .release = single_release
+};
+
+/* module parameters */
+int minors = MINOR_NUMBER;
+module_param(minors, int, S_IRUSR | S_IRGRP);
+module_param_cb(enabled, &enabled_ops, NULL, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+module_param_cb(byte_in_buffer, &byte_in_buffer_ops, NULL, S_IRUSR | S_IRGRP);
+module_param_cb(thread_in_wait, &thread_in_wait_ops, NULL, S_IRUSR | S_IRGRP);
+
+/* priority levels, policy and capacity of each flow, read at load time */
+int flows = FLOWS;
+bool flow_deferred[MAX_FLOWS] = { [LOW_PRIORITY] = true };
+int flow_capacity[MAX_FLOWS];
+module_param(flows, int, S_IRUSR | S_IRGRP);
+module_param_array(flow_deferred, bool, NULL, S_IRUSR | S_IRGRP);
+module_param_array(flow_capacity, int, NULL, S_IRUSR | S_IRGRP);
+
+/* thresholds of deferred flushes */
+int flush_bytes = FLUSH_BYTES;
+int flush_delay_ms = FLUSH_DELAY_MS;
+module_param(flush_bytes, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+module_param(flush_delay_ms, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+
+/* placement of the shared flush workqueue, read at load time */
+bool flush_highpri = false;
+int flush_cpu = -1;
+module_param(flush_highpri, bool, S_IRUSR | S_IRGRP);
+module_param(flush_cpu, int, S_IRUSR | S_IRGRP);
 
 /* functions prototypes */
+static object_t *alloc_object(int);
+static void     free_object(object_t *);
+static object_t *get_object(int);
+static void     put_object(object_t *);
+static void     free_shards(dynamic_buffer_t **, int);
+static bool     is_object_empty(object_t *);
 static int      dev_open(struct inode *, struct file *);
 static int      dev_release(struct inode *, struct file *);
-void            deferred_write(struct work_struct *);
-static ssize_t  dev_write(struct file *, const char *, size_t, loff_t *);
-static ssize_t  dev_read(struct file *, char *, size_t, loff_t *);
+void            flush_deferred_writes(struct work_struct *);
+static int      flush_target_cpu(void);
+static bool     flow_ready(flow_waiter_t *);
+static int      flow_wake_function(struct wait_queue_entry *, unsigned int, int, void *);
+static int      flow_wake_low_function(struct wait_queue_entry *, unsigned int, int, void *);
+static int      flow_wait(flow_waiter_t *, struct mutex *, ktime_t);
+static ktime_t  next_deadline(session_t *);
+static void     busy_poll(session_t *, flow_waiter_t *);
+static int      wait_for_space(session_t *, struct mutex *, gfp_t, bool, long);
+static long     session_to_read(session_t *);
+static int      subscribe_cursor(session_t *);
+static void     unsubscribe_cursor(session_t *);
+static void     set_session_priority(session_t *, int);
+static int      wait_for_data(session_t *, bool);
+static int      wait_for_flows(session_t *, bool);
+static bool     member_ready(group_member_t *, int);
+static group_member_t *group_ready(group_t *);
+static int      group_wake_function(struct wait_queue_entry *, unsigned int, int, void *);
+static int      wait_for_group(session_t *, bool, group_member_t **);
+static dynamic_buffer_t *pick_shard(object_t *);
+static long     reserve_space(object_t *, long);
+static int      read_shards(object_t *, struct iov_iter *, int);
+static int      read_flow(object_t *, int, struct iov_iter *, int);
+static int      read_records(object_t *, int, struct iov_iter *, u32 *, int, bool);
+static void     stage_write(object_t *, int, packed_work_t *, struct list_head *, long);
+static void     publish_write(object_t *, int, long);
+static ssize_t  dev_write_iter(struct kiocb *, struct iov_iter *);
+static ssize_t  dev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t  dev_read_flows(struct kiocb *, struct iov_iter *);
+static ssize_t  dev_read_group(struct kiocb *, struct iov_iter *);
+static ssize_t  dev_splice_read(struct file *, loff_t *, struct pipe_inode_info *, size_t, unsigned int);
+static __poll_t dev_poll(struct file *, poll_table *);
+static int      dev_mmap(struct file *, struct vm_area_struct *);
+static int      dev_fsync(struct file *, loff_t, loff_t, int);
+static void     drain_object(object_t *);
+static int      set_ring_mode(object_t *);
+static int      set_sharded_mode(object_t *, unsigned long);
+static int      set_broadcast_mode(session_t *, unsigned long);
+static int      set_record_mode(object_t *);
+static long     discard_flow(session_t *, unsigned long);
+static long     read_record_batch(session_t *, unsigned long);
+static int      join_group(session_t *, unsigned long);
+static void     free_group(group_t *);
 static ssize_t  dev_ioctl(struct file *, unsigned int, unsigned long);
+static long     stage_payload(submit_entry_t *, struct list_head *);
+static long     submit_entry(object_t *, int, submit_payload_t *);
+static long     submit_batch(unsigned long);
+static long     ctl_ioctl(struct file *, unsigned int, unsigned long);
 int             init_module(void);
 void            cleanup_module(void);
 
 /* driver operations setting */
 static struct file_operations fops = {
         .owner = THIS_MODULE,
-        .write = dev_write,
-        .read = dev_read,
+#ifdef FOP_NOWAIT
+        .fop_flags = FOP_NOWAIT,
+#endif
+        .write_iter = dev_write_iter,
+        .read_iter = dev_read_iter,
+        .splice_write = iter_file_splice_write,
+        .splice_read = dev_splice_read,
+        .poll = dev_poll,
+        .mmap = dev_mmap,
+        .fsync = dev_fsync,
         .open =  dev_open,
         .release = dev_release,
         .unlocked_ioctl = dev_ioctl
 };
 
+/* control node operations setting */
+static struct file_operations ctl_fops = {
+        .owner = THIS_MODULE,
+        .unlocked_ioctl = ctl_ioctl
+};
+
+/**
+ * alloc_object - allocation of the I/O object of a minor
+ * @minor:      minor of device
+ * 
+ * Returns pointer to object, NULL if allocation fails.
+ */
+static object_t *alloc_object(int minor)
+{
+        int i;
+        object_t *object;
+
+        object = kmem_cache_zalloc(object_cache, GFP_KERNEL);
+        if (unlikely(!object))
+                return NULL;
+
+        object->minor = minor;
+
+        init_llist_head(&(object->staged));
+        INIT_DELAYED_WORK(&(object->flush_work), flush_deferred_writes);
+
+        init_chunk_pool(&(object->pool));
+
+        for (i = 0; i < flows; i++) {
+                object->buffer[i] = alloc_dynamic_buffer(&(object->pool));
+                if (unlikely(!object->buffer[i]))
+                        goto free_buffers;
+
+                object->buffer[i]->capacity = flow_capacity[i];
+                object->buffer[i]->deferred = flow_deferred[i];
+        }
+
+        return object;
+
+        // goto label for manage free
+free_buffers:   for (i--; i > -1; i--)
+                        free_dynamic_buffer(object->buffer[i]);
+                free_chunk_pool(&(object->pool));
+                kmem_cache_free(object_cache, object);
+                return NULL;
+}
+
+/**
+ * free_object - free the I/O object of a minor
+ * @object:     pointer to object, it has no sessions and no pending flush
+ */
+static void free_object(object_t *object)
+{
+        int i;
+
+        for (i = 0; i < flows; i++)
+                free_dynamic_buffer(object->buffer[i]);
+        free_chunk_pool(&(object->pool));
+
+        if (object->ring)
+                free_ring(object->ring);
+
+        if (object->shards)
+                free_shards(object->shards, object->nr_shards);
+
+        kmem_cache_free(object_cache, object);
+
+        return;
+}
+
+/**
+ * free_shards - free the sub-queues of a sharded flow
+ * @shards:     array of sub-queues
+ * @nr_shards:  number of sub-queues
+ */
+static void free_shards(dynamic_buffer_t **shards, int nr_shards)
+{
+        int i;
+
+        for (i = 0; i < nr_shards; i++)
+                if (shards[i])
+                        free_dynamic_buffer(shards[i]);
+
+        kfree(shards);
+
+        return;
+}
+
+/**
+ * is_object_empty - check if all flows of a minor are empty
+ * @object:     I/O object of the minor
+ * 
+ * Returns true if no flow holds data.
+ */
+static bool is_object_empty(object_t *object)
+{
+        int i;
+
+        for (i = 0; i < flows; i++)
+                if (!is_empty(i,object))
+                        return false;
+
+        return true;
+}
+
+/**
+ * get_object - take a reference to the I/O object of a minor
+ * @minor:      minor of device
+ * 
+ * The I/O object of the minor is allocated by its first user.
+ * 
+ * Returns pointer to object, otherwise an error pointer.
+ */
+static object_t *get_object(int minor)
+{
+        object_t *object;
+
+        mutex_lock(&devices_mutex);
+
+        // check if multi-flow device is enabled for this minor
+        if (!enabled[minor]) {
+                object = ERR_PTR(-EINVAL);
+                goto unlock;
+        }
+
+        object = devices[minor];
+        if (!object) {
+                object = alloc_object(minor);
+                if (unlikely(!object)) {
+                        object = ERR_PTR(-ENOMEM);
+                        goto unlock;
+                }
+                devices[minor] = object;
+        }
+
+        object->sessions++;
+
+        // goto label for manage unlock
+unlock: mutex_unlock(&devices_mutex);
+        return object;
+}
+
+/**
+ * put_object - drop a reference to the I/O object of a minor
+ * @object:     I/O object of the minor
+ * 
+ * The last user frees the I/O object if all flows are empty. Otherwise
+ * the object keeps its data for the next user. Staged writes are flushed
+ * first, without devices_mutex and still holding the reference, so the
+ * check sees them in the flows and no work item is left on the object.
+ */
+static void put_object(object_t *object)
+{
+        mutex_lock(&devices_mutex);
+
+        while (object->sessions == 1 && atomic_long_read(&(object->staged_byte))) {
+                mutex_unlock(&devices_mutex);
+                flush_delayed_work(&(object->flush_work));
+                mutex_lock(&devices_mutex);
+        }
+
+        if (--object->sessions == 0) {
+                // the flush work may still be finishing
+                flush_delayed_work(&(object->flush_work));
+
+                if (is_object_empty(object)) {
+                        devices[object->minor] = NULL;
+                        free_object(object);
+                }
+        }
+
+        mutex_unlock(&devices_mutex);
+}
+
 /**
  * dev_open - manage session opening for a certain minor
  * @inode:      I/O metadata of the device file
  * @file:       I/O session to the device file
  * 
+ * The I/O object of the minor is allocated by its first session. The
+ * control node only serves ioctl requests.
+ * 
  * Returns 0 if the operation is successful, otherwise a negative value.
  */
 static int dev_open(struct inode *inode, struct file *file)
 {
         int minor;
+        object_t *object;
         session_t *session;
 
         minor = get_minor(file);
 
-        if (minor >= MINOR_NUMBER) {
+        if (minor == minors) {
+                replace_fops(file, fops_get(&ctl_fops));
+                return 0;
+        }
+
+        if (minor > minors) {
                 return -ENODEV;
         }
 
-        // check if multi-flow device is enabled for this minor
-        if (!enabled[minor])
-                return -EINVAL;
-        
         session = kmalloc(sizeof(session_t), GFP_KERNEL);
         if (unlikely(!session))
                 return -ENOMEM;
 
+        object = get_object(minor);
+        if (IS_ERR(object)) {
+                kfree(session);
+                return PTR_ERR(object);
+        }
+
+        session->object = object;
         session->priority = HIGH_PRIORITY;
         session->flags = GFP_KERNEL;
-        session->timeout = MAX_SECONDS;
+        session->timeout = ktime_set(MAX_SECONDS, 0);
+        session->deadline = 0;
+        session->read_lowat = 1;
+        session->write_lowat = 0;
+        session->busy_poll_max = 0;
+        session->busy_poll_cur = 0;
+        session->weight = 0;
+        session->low_credit = 0;
+        session->cursor = NULL;
+        session->peek = false;
+        session->group = NULL;
 
         file->private_data = session;
 
+#ifdef FMODE_NOWAIT
+        // read_iter and write_iter honor IOCB_NOWAIT
+        file->f_mode |= FMODE_NOWAIT;
+#endif
+
 #ifdef DEBUG         
         printk(KERN_INFO "%s-%d: device file successfully opened for object\n", MODNAME, minor);
 #endif
@@ -96,11 +450,27 @@ static int dev_open(struct inode *inode, struct file *file)
  * @inode:      I/O metadata of the device file
  * @file:       I/O session to the device file
  * 
+ * The last session frees the I/O object, see put_object.
+ * 
  * Returns 0.
  */
 static int dev_release(struct inode *inode, struct file *file)
 {
-        kfree(file->private_data);
+        session_t *session;
+        object_t *object;
+
+        session = (session_t *)file->private_data;
+        object = session->object;
+
+        if (session->cursor)
+                unsubscribe_cursor(session);
+
+        if (session->group)
+                free_group(session->group);
+
+        put_object(object);
+
+        kfree(session);
         file->private_data = NULL;
 
 #ifdef DEBUG 
@@ -110,259 +480,2519 @@ static int dev_release(struct inode *inode, struct file *file)
 }
 
 /**
- * deferred_write - deferred write for low priority flow
- * @data:      work pointer to run write
+ * flush_deferred_writes - move the staged writes of a minor in their deferred flows
+ * @data:      flush work of the object
  * 
+ * All the writes staged so far for a flow are appended with one lock
+ * acquisition and its readers are woken once. The staged list is a
+ * stack, so it is reversed to keep the order of the writes.
  */
-void deferred_write(struct work_struct *data)
+void flush_deferred_writes(struct work_struct *data)
 {
-        packed_work_t *work = container_of((void*)data,packed_work_t,the_work);
-        object_t *object = devices + work->minor;
-        dynamic_buffer_t *buffer = object->buffer[LOW_PRIORITY];
+        int priority;
+        long total;
+        long size[MAX_FLOWS] = { 0 };
+        object_t *object;
+        dynamic_buffer_t *buffer;
+        struct llist_node *batch;
+        packed_work_t *work;
+        packed_work_t *next;
+
+        object = container_of(to_delayed_work(data), object_t, flush_work);
+        total = 0;
+
+        batch = llist_del_all(&(object->staged));
+        if (!batch)
+                return;
+
+        batch = llist_reverse_order(batch);
+
+        llist_for_each_entry(work, batch, node)
+                size[work->priority] += work->size;
+
+        for (priority = 0; priority < flows; priority++) {
+                if (!size[priority])
+                        continue;
+
+                buffer = object->buffer[priority];
+
+                mutex_lock(&(buffer->tail_mutex));
+
+                llist_for_each_entry(work, batch, node)
+                        if (work->priority == priority)
+                                write_dynamic_buffer(buffer, &(work->staging_area));
+
+                sub_booked_byte(priority,object,size[priority]);
+                add_byte_in_buffer(priority,object,size[priority]);
 
-        mutex_lock(&(buffer->op_mutex));
+                mutex_unlock(&(buffer->tail_mutex));
 
-        write_dynamic_buffer(object->buffer[LOW_PRIORITY], work->staging_area);
+                wake_up_readers(buffer);
+
+                total += size[priority];
+        }
+
+        atomic_long_sub(total, &(object->staged_byte));
 
 #ifdef DEBUG 
-        printk(KERN_INFO "%s-%d: deferred write of '%s' completed", MODNAME, work->minor, work->staging_area->content);
+        printk(KERN_INFO "%s-%d: deferred write of %ld byte completed", MODNAME, object->minor, total);
 #endif
-        sub_booked_byte(work->minor,work->staging_area->size);
-        add_byte_in_buffer(LOW_PRIORITY,work->minor,work->staging_area->size);
 
-        mutex_unlock(&(buffer->op_mutex));
+        llist_for_each_entry_safe(work, next, batch, node)
+                kmem_cache_free(work_cache, work);
+}
+
+/**
+ * flush_target_cpu - CPU that runs the flushes
+ * 
+ * Returns flush_cpu when it is online, otherwise WORK_CPU_UNBOUND.
+ */
+static int flush_target_cpu(void)
+{
+        if (flush_cpu < 0 || flush_cpu >= nr_cpu_ids || !cpu_online(flush_cpu))
+                return WORK_CPU_UNBOUND;
+
+        return flush_cpu;
+}
+
+/**
+ * flow_ready - check if the need of a waiter is met
+ * @waiter:     thread waiting on a flow
+ * 
+ * Returns true if the flow has enough free space or data.
+ */
+static bool flow_ready(flow_waiter_t *waiter)
+{
+        if (waiter->writer)
+                return free_space(waiter->priority,waiter->object) >= waiter->need;
+
+        if (waiter->both)
+                return byte_to_read_flows(waiter->object) >= waiter->need;
+
+        if (waiter->cursor)
+                return cursor_to_read(waiter->object->buffer[waiter->priority], waiter->cursor) >= waiter->need;
 
-        kfree(container_of((void*)data,packed_work_t,the_work));
+        return byte_to_read(waiter->priority,waiter->object) >= waiter->need;
+}
 
-        wake_up_interruptible(&(object->buffer[LOW_PRIORITY]->waitqueue));
+/**
+ * flow_wake_function - wake a waiter only if its need is met
+ * @entry:      entry of the waiter
+ * @mode:       task state to wake
+ * @sync:       wake flags
+ * @key:        poll mask of the wakeup, unused
+ * 
+ * A waiter whose need is not met is skipped and does not consume the
+ * exclusive wakeup, that goes on to the next waiter.
+ * 
+ * Returns nonzero if the waiter is woken.
+ */
+static int flow_wake_function(struct wait_queue_entry *entry, unsigned int mode, int sync, void *key)
+{
+        if (!flow_ready(container_of(entry, flow_waiter_t, entry)))
+                return 0;
 
-        module_put(THIS_MODULE);
+        return default_wake_function(entry, mode, sync, key);
 }
 
 /**
- * dev_write - write operation of driver
- * @filp:       I/O session to the device file
- * @buff:       buffer that contain data to write
- * @len:        size of content to write
+ * flow_wake_low_function - wake a reader of both flows from the low priority queue
+ * @entry:      low priority entry of the waiter
+ * @mode:       task state to wake
+ * @sync:       wake flags
+ * @key:        poll mask of the wakeup, unused
  * 
- * Returns:
- *  written bytes number when the operation is successful
- *  a negative value when error occurs
+ * Returns nonzero if the waiter is woken.
+ */
+static int flow_wake_low_function(struct wait_queue_entry *entry, unsigned int mode, int sync, void *key)
+{
+        if (!flow_ready(container_of(entry, flow_waiter_t, low_entry)))
+                return 0;
+
+        return default_wake_function(entry, mode, sync, key);
+}
+
+/**
+ * flow_wait - lock a flow once the need of a waiter is met
+ * @waiter:     thread waiting on a flow
+ * @mutex:      mutex of the side of the flow to lock
+ * @deadline:   absolute CLOCK_MONOTONIC deadline
+ * 
+ * The waiter sleeps in exclusive mode without holding @mutex and is
+ * woken only when its need is met. It then takes @mutex, checks the need
+ * again and goes back to sleep if another thread consumed it first. A
+ * waiter that leaves while the need is met passes the wakeup on.
+ * 
+ * A reader of both flows sleeps on the readers waitqueues of both and
+ * @mutex is head_mutex of the high priority flow.
+ * 
+ * A waiter on a flow in ring mode is counted in the mapped header, so
+ * user space producers and consumers that move the indexes notify it.
+ * 
+ * The sleep is bounded by a high resolution timer, with the timer slack
+ * of the task.
+ * 
+ * Returns 1 with @mutex held, 0 if deadline expires, -ERESTARTSYS if a
+ * signal arrives.
  */
-static ssize_t dev_write(struct file *filp, const char *buff, size_t len, loff_t *off)
+static int flow_wait(flow_waiter_t *waiter, struct mutex *mutex, ktime_t deadline)
 {
         int ret;
-        int byte_not_copied;
-        int minor;
-        char *temp_buffer;
-        object_t *object;
-        session_t *session;
+        ring_t *ring;
+        wait_queue_head_t *wq;
+        wait_queue_head_t *low_wq;
         dynamic_buffer_t *buffer;
-        data_segment_t *segment_to_write;
-        packed_work_t *the_task;
 
-        minor = get_minor(filp);
-        object = devices + minor;
-        session = (session_t *)filp->private_data;
-        buffer = object->buffer[session->priority];
-        the_task = NULL;
+        buffer = waiter->object->buffer[waiter->priority];
+        wq = waiter->writer ? &(buffer->writers) : &(buffer->readers);
+        low_wq = &(waiter->object->buffer[LOW_PRIORITY]->readers);
 
-#ifdef DEBUG 
-        printk(KERN_INFO "%s-%d: write called\n", MODNAME, minor);
-#endif
+        init_waitqueue_func_entry(&(waiter->entry), flow_wake_function);
+        waiter->entry.private = current;
 
-        // copy data to write in a temporary buffer
-        temp_buffer = kmalloc(len, session->flags);
-        if (unlikely(!temp_buffer))
-                return -ENOMEM;
-        byte_not_copied = copy_from_user(temp_buffer, buff, len);
+        if (waiter->both) {
+                init_waitqueue_func_entry(&(waiter->low_entry), flow_wake_low_function);
+                waiter->low_entry.private = current;
+        }
 
-        // prepare memory areas
-        segment_to_write = kmalloc(sizeof(data_segment_t), session->flags);
-        if (unlikely(!segment_to_write)) {
-                kfree(temp_buffer);
-                return -ENOMEM;
+        // the ring is checked again by flow_ready after the waiter is counted
+        ring = is_ring_mode(waiter->priority,waiter->object) ? waiter->object->ring : NULL;
+        if (ring) {
+                ring_mark_waiter(ring, waiter->writer, 1);
+                smp_mb();
         }
 
-        if (session->priority == LOW_PRIORITY) {
-                the_task =  kmalloc(sizeof(packed_work_t),session->flags);
-                if (unlikely(!the_task)) {
-                        kfree(temp_buffer);
-                        kfree(segment_to_write);
-                        return -ENOMEM;
+        for (;;) {
+                prepare_to_wait_exclusive(wq, &(waiter->entry), TASK_INTERRUPTIBLE);
+                if (waiter->both)
+                        prepare_to_wait_exclusive(low_wq, &(waiter->low_entry), TASK_INTERRUPTIBLE);
+
+                if (flow_ready(waiter)) {
+                        finish_wait(wq, &(waiter->entry));
+                        if (waiter->both)
+                                finish_wait(low_wq, &(waiter->low_entry));
+
+                        if (mutex_lock_interruptible(mutex)) {
+                                ret = -ERESTARTSYS;
+                                break;
+                        }
+
+                        if (flow_ready(waiter)) {
+                                if (ring)
+                                        ring_mark_waiter(ring, waiter->writer, -1);
+                                return 1;
+                        }
+
+                        mutex_unlock(mutex);
+                        continue;
                 }
-        }
 
-        // check if thread must block
-        if(is_blocking(session->flags)) {
-                atomic_inc_thread_in_wait(session->priority, minor);
+                if (signal_pending(current)) {
+                        ret = -ERESTARTSYS;
+                        break;
+                }
 
-                ret = personal_wait(
-                        buffer->waitqueue, 
-                        lock_and_awake(
-                                is_there_space(session->priority,minor),
-                                &(buffer->op_mutex)
-                                ),
-                        session->timeout*CONFIG_HZ
-                );
+                if (ktime_compare(ktime_get(), deadline) >= 0) {
+                        ret = 0;
+                        break;
+                }
 
-                atomic_dec_thread_in_wait(session->priority, minor);
+                schedule_hrtimeout_range(&deadline, current->timer_slack_ns, HRTIMER_MODE_ABS);
+        }
 
-                // check result of wait
-                if (ret == 0) 
-                        goto free_area;
-                if (ret == -ERESTARTSYS) {
-                        ret = -EINTR;
-                        goto free_area;
-                }
-        } else {
-                if (!mutex_trylock(&(buffer->op_mutex))) {
-                        ret = -EBUSY;
-                        goto free_area;
-                }
-                
-                if (is_empty(session->priority,minor)) {
-                        ret = 0;
-                        goto unlock_wake;
+        finish_wait(wq, &(waiter->entry));
+        if (waiter->both)
+                finish_wait(low_wq, &(waiter->low_entry));
+
+        if (ring)
+                ring_mark_waiter(ring, waiter->writer, -1);
+
+        // the wakeup received may be the only one for the current need
+        if (flow_ready(waiter)) {
+                if (waiter->writer) {
+                        wake_up_writers(buffer);
+                } else {
+                        wake_up_readers(buffer);
+                        if (waiter->both)
+                                wake_up_readers(waiter->object->buffer[LOW_PRIORITY]);
                 }
         }
 
-        if (len-byte_not_copied > free_space(session->priority,minor)) 
-                len = free_space(session->priority,minor);
-        else 
-                len = len - byte_not_copied;
+        return ret;
+}
 
-        init_data_segment(segment_to_write, temp_buffer, len);
+/**
+ * next_deadline - deadline of a blocking operation of a session
+ * @session:    I/O session
+ * 
+ * A deadline set with the DEADLINE ioctl holds for one operation only,
+ * otherwise the timeout of the session starts now.
+ * 
+ * Returns absolute CLOCK_MONOTONIC deadline.
+ */
+static ktime_t next_deadline(session_t *session)
+{
+        ktime_t deadline;
 
-        // write data segment
-        if (session->priority == HIGH_PRIORITY) {
-                write_dynamic_buffer(buffer, segment_to_write);
-                add_byte_in_buffer(HIGH_PRIORITY,minor,len);
-                wake_up_interruptible(&(buffer->waitqueue));
-#ifdef DEBUG 
-                printk(KERN_INFO "%s-%d: %ld byte are written\n", MODNAME, minor, len);
-#endif
-        } else {
-                if(!try_module_get(THIS_MODULE)) {
-                        ret = -ENODEV;
-                        goto unlock_wake;
-                }
+        deadline = session->deadline;
+        if (deadline) {
+                session->deadline = 0;
+                return deadline;
+        }
 
-                the_task->staging_area = segment_to_write;
-                the_task->minor = minor;
+        return ktime_add_safe(ktime_get(), session->timeout);
+}
 
-                __INIT_WORK(&(the_task->the_work),(void*)deferred_write,(unsigned long)(&(the_task->the_work)));
+/**
+ * busy_poll - spin on a flow before sleeping on it
+ * @session:    I/O session
+ * @waiter:     reader about to wait on the flow
+ * 
+ * The reader spins for the adaptive budget of the session, checking
+ * the flow with cpu_relax, and gives up as soon as it must reschedule.
+ * A hit grows the budget to twice the spin it took, up to the budget
+ * set by the user. A miss halves it, down to MIN_BUSY_POLL_NSEC, so idle
+ * flows cost almost nothing.
+ */
+static void busy_poll(session_t *session, flow_waiter_t *waiter)
+{
+        u64 start;
+        u64 elapsed;
 
-                add_booked_byte(minor,len);
+        start = local_clock();
 
-                queue_work(object->workqueue, &(the_task->the_work));
-#ifdef DEBUG 
-                printk(KERN_INFO "%s-%d: '%s' queued", MODNAME, minor, segment_to_write->content);
-#endif
-        }
+        while (!flow_ready(waiter)) {
+                elapsed = local_clock() - start;
 
-        mutex_unlock(&(object->buffer[session->priority]->op_mutex));
+                if (elapsed >= session->busy_poll_cur) {
+                        session->busy_poll_cur = max_t(u64, session->busy_poll_cur / 2, MIN_BUSY_POLL_NSEC);
+                        return;
+                }
 
-        return len;
+                if (need_resched() || signal_pending(current))
+                        return;
 
-        // goto label for manage free and unlock
-unlock_wake:    mutex_unlock(&(buffer->op_mutex));
-                wake_up_interruptible(&(buffer->waitqueue));
-free_area:      kfree(temp_buffer);
-                free_data_segment(segment_to_write);
-                kfree(the_task);
-                return ret;
+                cpu_relax();
+        }
+
+        elapsed = local_clock() - start;
+        session->busy_poll_cur = clamp_t(u64, 2 * elapsed, session->busy_poll_cur, session->busy_poll_max);
 }
 
 /**
- * dev_read - read operation of driver
- * @filp:       I/O session to the device file
- * @buff:       buffer that contain read data
- * @len:        bytes number to be read
+ * wait_for_space - lock the flow of a session once it has free space
+ * @session:    I/O session
+ * @mutex:      tail mutex to lock, of the flow or of a sub-queue of it
+ * @flags:      flags of the operation (blocking or not)
+ * @nowait:     true if the operation must fail with -EAGAIN instead of waiting
+ * @len:        bytes to write
  * 
- * Returns:
- *  read bytes number when the operation is successful
- *  a negative value when error occurs
+ * A blocking writer waits until @len bytes fit, or the write low
+ * watermark of the session if it is set and smaller. In record mode the
+ * whole record must fit, so the watermark does not apply.
+ * 
+ * Returns 1 with @mutex held, otherwise the value the write operation
+ * returns.
  */
-static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off)
+static int wait_for_space(session_t *session, struct mutex *mutex, gfp_t flags, bool nowait, long len)
 {
         int ret;
-        int minor;
-        char *temp_buffer;
         object_t *object;
-        session_t *session;
-        dynamic_buffer_t *buffer;
-
-        minor = get_minor(filp);
-        object = devices + minor;
-        session = (session_t *)filp->private_data;
-        buffer = object->buffer[session->priority];
+        flow_waiter_t waiter;
 
-#ifdef DEBUG      
-        printk(KERN_INFO "%s-%d: read called\n",MODNAME,minor);
-#endif
-        if (len == 0)
-                return 0;
+        object = session->object;
 
-        temp_buffer = kmalloc(len, session->flags);
-        if (unlikely(!temp_buffer))
-                return -ENOMEM;
+        // check if thread must block
+        if(is_blocking(flags) && !nowait) {
+                waiter.object = object;
+                waiter.priority = session->priority;
+                waiter.writer = true;
+                waiter.both = false;
+                waiter.cursor = NULL;
+                waiter.need = session->write_lowat && !object->record ? min(len, session->write_lowat) : len;
+                waiter.need = max(waiter.need, 1L);
 
-        if(is_blocking(session->flags)) {
-                atomic_inc_thread_in_wait(session->priority, minor);
+                atomic_inc_thread_in_wait(session->priority, object);
 
-                ret = personal_wait(
-                        buffer->waitqueue, 
-                        lock_and_awake(
-                                byte_to_read(session->priority,minor) > 0,
-                                &(buffer->op_mutex)
-                                ),
-                        session->timeout*CONFIG_HZ
-                );
+                ret = flow_wait(&waiter, mutex, next_deadline(session));
 
-                atomic_dec_thread_in_wait(session->priority, minor);
+                atomic_dec_thread_in_wait(session->priority, object);
 
                 // check result of wait
-                if (ret == 0) {
-                        kfree(temp_buffer);
-                        return 0;
-                }
-                if (ret == -ERESTARTSYS) {
-                        kfree(temp_buffer);
+                if (ret == -ERESTARTSYS)
                         return -EINTR;
-                }
-        } else {
-                if (!mutex_trylock(&(buffer->op_mutex))) {
-                        kfree(temp_buffer);
-                        return -EBUSY;
-                }
-                        
-                if (is_empty(session->priority,minor)) {
-                        mutex_unlock(&(buffer->op_mutex));
-                        wake_up_interruptible(&(buffer->waitqueue));
-                        kfree(temp_buffer);
-                        return 0;
-                }
+                return ret ? 1 : 0;
         }
- 
-        if(len > byte_to_read(session->priority,minor))
-                len = byte_to_read(session->priority,minor);
-
-        read_dynamic_buffer(buffer, temp_buffer, len);
-
-        sub_byte_in_buffer(session->priority,minor,len);
-
-        wake_up_interruptible(&(buffer->waitqueue));
 
-        mutex_unlock(&(buffer->op_mutex));
+        if (!mutex_trylock(mutex))
+                return nowait ? -EAGAIN : -EBUSY;
 
-        ret = copy_to_user(buff,temp_buffer,len);
-
-#ifdef DEBUG 
-        printk(KERN_INFO "%s-%d: %ld byte are read\n",MODNAME,minor,len-ret);
-#endif
+        if (is_full(session->priority,object)) {
+                mutex_unlock(mutex);
+                return nowait ? -EAGAIN : 0;
+        }
 
-        return len - ret;
+        return 1;
+}
+
+/**
+ * session_to_read - bytes a session can read from its flow
+ * @session:    I/O session
+ * 
+ * Returns the bytes after the cursor of the session for a broadcast
+ * flow, otherwise the bytes of the flow.
+ */
+static long session_to_read(session_t *session)
+{
+        dynamic_buffer_t *buffer;
+
+        buffer = session->object->buffer[session->priority];
+
+        if (buffer->broadcast && has_cursor(session))
+                return cursor_to_read(buffer, session->cursor);
+
+        return byte_to_read(session->priority,session->object);
+}
+
+/**
+ * subscribe_cursor - give a session a cursor on its broadcast flow
+ * @session:    I/O session
+ * 
+ * The cursor starts after the last byte written, so the session reads
+ * only the data written from now on. A cursor on another flow is
+ * dropped first.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int subscribe_cursor(session_t *session)
+{
+        cursor_t *cursor;
+        dynamic_buffer_t *buffer;
+
+        if (has_cursor(session))
+                return 0;
+
+        if (session->cursor)
+                unsubscribe_cursor(session);
+
+        cursor = kmalloc(sizeof(cursor_t), GFP_KERNEL);
+        if (unlikely(!cursor))
+                return -ENOMEM;
+
+        cursor->priority = session->priority;
+        buffer = session->object->buffer[cursor->priority];
+
+        // the tail is stable only under tail_mutex
+        mutex_lock(&(buffer->tail_mutex));
+        mutex_lock(&(buffer->head_mutex));
+
+        attach_cursor(buffer, cursor);
+
+        mutex_unlock(&(buffer->head_mutex));
+        mutex_unlock(&(buffer->tail_mutex));
+
+        session->cursor = cursor;
+
+        return 0;
+}
+
+/**
+ * unsubscribe_cursor - drop the cursor of a session
+ * @session:    I/O session with a cursor
+ * 
+ * The data segments kept only by the cursor are freed and writers are
+ * woken for the space released.
+ */
+static void unsubscribe_cursor(session_t *session)
+{
+        long freed;
+        object_t *object;
+        cursor_t *cursor;
+        dynamic_buffer_t *buffer;
+
+        object = session->object;
+        cursor = session->cursor;
+        buffer = object->buffer[cursor->priority];
+
+        mutex_lock(&(buffer->head_mutex));
+
+        detach_cursor(buffer, cursor);
+        freed = trim_cursors(buffer);
+        sub_byte_in_buffer(cursor->priority,object,freed);
+
+        mutex_unlock(&(buffer->head_mutex));
+
+        if (freed)
+                wake_up_writers(buffer);
+
+        session->cursor = NULL;
+        kfree(cursor);
+
+        return;
+}
+
+/**
+ * set_session_priority - move a session to another flow
+ * @session:    I/O session
+ * @priority:   flow of the session from now on
+ * 
+ * A cursor on the old flow is dropped, so it no longer holds back the
+ * writers of that flow.
+ */
+static void set_session_priority(session_t *session, int priority)
+{
+        if (session->cursor && session->cursor->priority != priority)
+                unsubscribe_cursor(session);
+
+        session->priority = priority;
+}
+
+/**
+ * wait_for_data - lock the flow of a session once it holds bytes to read
+ * @session:    I/O session
+ * @nowait:     true if the operation must fail with -EAGAIN instead of waiting
+ * 
+ * A blocking reader waits until the flow holds the read low watermark
+ * of the session. If the timeout expires first, it reads what is there.
+ * With a busy-poll budget, the reader spins before sleeping.
+ * 
+ * Returns 1 with head_mutex held, otherwise the value the read operation
+ * returns.
+ */
+static int wait_for_data(session_t *session, bool nowait)
+{
+        int ret;
+        ktime_t deadline;
+        object_t *object;
+        dynamic_buffer_t *buffer;
+        flow_waiter_t waiter;
+
+        object = session->object;
+        buffer = object->buffer[session->priority];
+
+        if(is_blocking(session->flags) && !nowait) {
+                waiter.object = object;
+                waiter.priority = session->priority;
+                waiter.writer = false;
+                waiter.both = false;
+                waiter.cursor = buffer->broadcast && has_cursor(session) ? session->cursor : NULL;
+                waiter.need = session->read_lowat;
+                deadline = next_deadline(session);
+
+                atomic_inc_thread_in_wait(session->priority, object);
+
+                if (session->busy_poll_max)
+                        busy_poll(session, &waiter);
+
+                ret = flow_wait(&waiter, &(buffer->head_mutex), deadline);
+
+                atomic_dec_thread_in_wait(session->priority, object);
+
+                // check result of wait
+                if (ret == -ERESTARTSYS)
+                        return -EINTR;
+                if (ret)
+                        return 1;
+                if (waiter.need == 1)
+                        return 0;
+
+                // timeout expired below the watermark: take what is there
+                mutex_lock(&(buffer->head_mutex));
+                if (session_to_read(session) > 0)
+                        return 1;
+                mutex_unlock(&(buffer->head_mutex));
+                return 0;
+        }
+
+        if (!mutex_trylock(&(buffer->head_mutex)))
+                return nowait ? -EAGAIN : -EBUSY;
+
+        if (session_to_read(session) == 0) {
+                mutex_unlock(&(buffer->head_mutex));
+                return nowait ? -EAGAIN : 0;
+        }
+
+        return 1;
+}
+
+/**
+ * wait_for_flows - lock both flows of a session once they hold bytes to read
+ * @session:    I/O session
+ * @nowait:     true if the operation must fail with -EAGAIN instead of waiting
+ * 
+ * As wait_for_data, but the read low watermark counts the bytes of both
+ * flows and one wait covers both. The head mutexes are always taken high
+ * priority first.
+ * 
+ * Returns 1 with both head_mutex held, otherwise the value the read
+ * operation returns.
+ */
+static int wait_for_flows(session_t *session, bool nowait)
+{
+        int ret;
+        ktime_t deadline;
+        object_t *object;
+        dynamic_buffer_t *high;
+        dynamic_buffer_t *low;
+        flow_waiter_t waiter;
+
+        object = session->object;
+        high = object->buffer[HIGH_PRIORITY];
+        low = object->buffer[LOW_PRIORITY];
+
+        if(is_blocking(session->flags) && !nowait) {
+                waiter.object = object;
+                waiter.priority = HIGH_PRIORITY;
+                waiter.writer = false;
+                waiter.both = true;
+                waiter.cursor = NULL;
+                waiter.need = session->read_lowat;
+                deadline = next_deadline(session);
+
+                atomic_inc_thread_in_wait(HIGH_PRIORITY, object);
+                atomic_inc_thread_in_wait(LOW_PRIORITY, object);
+
+                if (session->busy_poll_max)
+                        busy_poll(session, &waiter);
+
+                for (;;) {
+                        ret = flow_wait(&waiter, &(high->head_mutex), deadline);
+                        if (ret != 1)
+                                break;
+
+                        // readers of the low priority flow only may have drained it
+                        mutex_lock_nested(&(low->head_mutex), SINGLE_DEPTH_NESTING);
+                        if (byte_to_read_flows(object) > 0)
+                                break;
+                        mutex_unlock(&(low->head_mutex));
+                        mutex_unlock(&(high->head_mutex));
+                }
+
+                atomic_dec_thread_in_wait(LOW_PRIORITY, object);
+                atomic_dec_thread_in_wait(HIGH_PRIORITY, object);
+
+                // check result of wait
+                if (ret == -ERESTARTSYS)
+                        return -EINTR;
+                if (ret)
+                        return 1;
+                if (waiter.need == 1)
+                        return 0;
+
+                // timeout expired below the watermark: take what is there
+                mutex_lock(&(high->head_mutex));
+                mutex_lock_nested(&(low->head_mutex), SINGLE_DEPTH_NESTING);
+                if (byte_to_read_flows(object) > 0)
+                        return 1;
+                goto unlock;
+        }
+
+        if (!mutex_trylock(&(high->head_mutex)))
+                return nowait ? -EAGAIN : -EBUSY;
+
+        if (!mutex_trylock(&(low->head_mutex))) {
+                mutex_unlock(&(high->head_mutex));
+                return nowait ? -EAGAIN : -EBUSY;
+        }
+
+        if (byte_to_read_flows(object) > 0)
+                return 1;
+
+        ret = nowait ? -EAGAIN : 0;
+
+        // goto label for manage unlock
+unlock: mutex_unlock(&(low->head_mutex));
+        mutex_unlock(&(high->head_mutex));
+        return ret;
+}
+
+/**
+ * member_ready - check if a member of a group can be read
+ * @member:     member of the group
+ * @priority:   priority of the flow read by the group
+ * 
+ * The flow of a member in broadcast mode is never read by the group,
+ * since cursors follow the minor of the session only, so its data does
+ * not make the member ready.
+ * 
+ * Returns true if the flow of the member holds data for the group.
+ */
+static bool member_ready(group_member_t *member, int priority)
+{
+        if (READ_ONCE(member->object->buffer[priority]->broadcast))
+                return false;
+
+        return byte_to_read(priority,member->object) > 0;
+}
+
+/**
+ * group_ready - member of a group with data to read
+ * @group:      minors read by a session
+ * 
+ * Members are checked in round-robin order from the one whose turn it is.
+ * 
+ * Returns pointer to member, NULL if no member holds data.
+ */
+static group_member_t *group_ready(group_t *group)
+{
+        int i;
+        group_member_t *member;
+
+        for (i = 0; i < group->count; i++) {
+                member = &(group->members[(group->next + i) % group->count]);
+                if (member_ready(member, group->priority))
+                        return member;
+        }
+
+        return NULL;
+}
+
+/**
+ * group_wake_function - wake a group reader only if the member has data
+ * @entry:      entry of the member
+ * @mode:       task state to wake
+ * @sync:       wake flags
+ * @key:        poll mask of the wakeup, unused
+ * 
+ * Returns nonzero if the reader is woken.
+ */
+static int group_wake_function(struct wait_queue_entry *entry, unsigned int mode, int sync, void *key)
+{
+        group_member_t *member;
+
+        member = container_of(entry, group_member_t, entry);
+        if (!member_ready(member, member->group->priority))
+                return 0;
+
+        return default_wake_function(entry, mode, sync, key);
+}
+
+/**
+ * wait_for_group - lock a member of the group of a session once it holds data
+ * @session:    I/O session, it holds the mutex of its group
+ * @nowait:     true if the operation must fail with -EAGAIN instead of waiting
+ * @member:     receives the member to read
+ * 
+ * A blocking reader sleeps in exclusive mode on the readers waitqueues
+ * of all members at once, as flow_wait does on one flow, and is woken by
+ * the first member that gets data.
+ * 
+ * Returns 1 with head_mutex of @member held, otherwise the value the
+ * read operation returns.
+ */
+static int wait_for_group(session_t *session, bool nowait, group_member_t **member)
+{
+        int i;
+        int ret;
+        ktime_t deadline;
+        group_t *group;
+        struct mutex *mutex;
+
+        group = session->group;
+        group->priority = session->priority;
+
+        if (!is_blocking(session->flags) || nowait) {
+                *member = group_ready(group);
+                if (!*member)
+                        return nowait ? -EAGAIN : 0;
+
+                mutex = &((*member)->object->buffer[group->priority]->head_mutex);
+                if (!mutex_trylock(mutex))
+                        return nowait ? -EAGAIN : -EBUSY;
+
+                if (!member_ready(*member, group->priority)) {
+                        mutex_unlock(mutex);
+                        return nowait ? -EAGAIN : 0;
+                }
+
+                return 1;
+        }
+
+        deadline = next_deadline(session);
+
+        for (i = 0; i < group->count; i++) {
+                init_waitqueue_func_entry(&(group->members[i].entry), group_wake_function);
+                group->members[i].entry.private = current;
+                atomic_inc_thread_in_wait(group->priority, group->members[i].object);
+        }
+
+        for (;;) {
+                for (i = 0; i < group->count; i++)
+                        prepare_to_wait_exclusive(&(group->members[i].object->buffer[group->priority]->readers),
+                                        &(group->members[i].entry), TASK_INTERRUPTIBLE);
+
+                *member = group_ready(group);
+                if (*member) {
+                        for (i = 0; i < group->count; i++)
+                                finish_wait(&(group->members[i].object->buffer[group->priority]->readers),
+                                                &(group->members[i].entry));
+
+                        mutex = &((*member)->object->buffer[group->priority]->head_mutex);
+                        if (mutex_lock_interruptible(mutex)) {
+                                ret = -EINTR;
+                                break;
+                        }
+
+                        if (member_ready(*member, group->priority)) {
+                                ret = 1;
+                                break;
+                        }
+
+                        mutex_unlock(mutex);
+                        continue;
+                }
+
+                if (signal_pending(current)) {
+                        ret = -EINTR;
+                        break;
+                }
+
+                if (ktime_compare(ktime_get(), deadline) >= 0) {
+                        ret = 0;
+                        break;
+                }
+
+                schedule_hrtimeout_range(&deadline, current->timer_slack_ns, HRTIMER_MODE_ABS);
+        }
+
+        for (i = 0; i < group->count; i++) {
+                finish_wait(&(group->members[i].object->buffer[group->priority]->readers),
+                                &(group->members[i].entry));
+                atomic_dec_thread_in_wait(group->priority, group->members[i].object);
+
+                // the wakeups received may be the only ones for other readers
+                if (ret <= 0 && byte_to_read(group->priority,group->members[i].object) > 0)
+                        wake_up_readers(group->members[i].object->buffer[group->priority]);
+        }
+
+        return ret;
+}
+
+/**
+ * pick_shard - sub-queue of a sharded flow for the current writer
+ * @object:     I/O object of the minor
+ * 
+ * In writer mode every thread always appends to the same sub-queue, so
+ * its writes are read in order. In CPU mode the sub-queue is the one of
+ * the current CPU and the order comes from the stamps of the writes.
+ * 
+ * Returns pointer to sub-queue.
+ */
+static dynamic_buffer_t *pick_shard(object_t *object)
+{
+        unsigned int index;
+
+        if (object->ordered)
+                index = raw_smp_processor_id();
+        else
+                index = task_pid_nr(current);
+
+        return object->shards[index % object->nr_shards];
+}
+
+/**
+ * reserve_space - book free space of a sharded flow
+ * @object:     I/O object of the minor
+ * @len:        bytes to write
+ * 
+ * Writers of different sub-queues run concurrently, so the free space of
+ * the flow is booked before the copy and released once the written
+ * bytes are accounted.
+ * 
+ * Returns number of booked bytes, 0 if the flow is full.
+ */
+static long reserve_space(object_t *object, long len)
+{
+        long old;
+        long booked;
+        long available;
+        dynamic_buffer_t *buffer;
+
+        buffer = object->buffer[HIGH_PRIORITY];
+        booked = atomic_long_read(&(buffer->booked_byte));
+
+        for (;;) {
+                available = buffer->capacity - atomic_long_read(&(buffer->byte_in_buffer)) - booked;
+                if (available <= 0)
+                        return 0;
+                available = min(len, available);
+
+                old = atomic_long_cmpxchg(&(buffer->booked_byte), booked, booked + available);
+                if (old == booked)
+                        return available;
+                booked = old;
+        }
+}
+
+/**
+ * read_shards - copy data of the sub-queues of a sharded flow to user
+ * @object:     I/O object of the minor
+ * @to:         iterator over user memory that receives read data
+ * @len:        number of bytes to read
+ * 
+ * The caller holds head_mutex of the flow, that serializes the readers
+ * of all the sub-queues. In writer mode the sub-queues are drained one
+ * after the other, starting from a different one at each read. In CPU
+ * mode the head with the oldest stamp is read first, so data already
+ * published is read in order of write time.
+ * 
+ * Returns number of bytes read.
+ */
+static int read_shards(object_t *object, struct iov_iter *to, int len)
+{
+        int i;
+        int run;
+        int to_read;
+        int copied;
+        int byte_read;
+        u64 stamp;
+        u64 min_stamp;
+        dynamic_buffer_t *shard;
+
+        byte_read = 0;
+
+        if (!object->ordered) {
+                for (i = 0; i < object->nr_shards && byte_read < len; i++) {
+                        shard = object->shards[(object->next_shard + i) % object->nr_shards];
+                        byte_read += read_dynamic_buffer(shard, to, len - byte_read);
+                }
+
+                object->next_shard = (object->next_shard + 1) % object->nr_shards;
+
+                return byte_read;
+        }
+
+        while (byte_read < len) {
+                shard = NULL;
+                min_stamp = U64_MAX;
+                to_read = 0;
+
+                for (i = 0; i < object->nr_shards; i++) {
+                        run = head_run(object->shards[i], &stamp);
+                        if (run > 0 && stamp < min_stamp) {
+                                min_stamp = stamp;
+                                shard = object->shards[i];
+                                to_read = run;
+                        }
+                }
+
+                if (!shard)
+                        break;
+
+                to_read = min(to_read, len - byte_read);
+                copied = read_dynamic_buffer(shard, to, to_read);
+                byte_read += copied;
+
+                if (copied < to_read)
+                        break;
+        }
+
+        return byte_read;
+}
+
+/**
+ * read_flow - copy data of a flow to user
+ * @object:     I/O object of the minor
+ * @priority:   priority of the flow
+ * @to:         iterator over user memory that receives read data
+ * @len:        number of bytes to read, not greater than bytes to read
+ * 
+ * The caller holds head_mutex of the flow.
+ * 
+ * Returns number of bytes read.
+ */
+static int read_flow(object_t *object, int priority, struct iov_iter *to, int len)
+{
+        int ret;
+
+        if (is_ring_mode(priority,object))
+                return read_ring(object->ring, to, len);
+
+        if (is_sharded(priority,object))
+                ret = read_shards(object, to, len);
+        else
+                ret = read_dynamic_buffer(object->buffer[priority], to, len);
+
+        sub_byte_in_buffer(priority,object,ret);
+
+        return ret;
+}
+
+/**
+ * read_records - read whole records of the flow of a minor in record mode
+ * @object:     I/O object of the minor
+ * @priority:   flow to read
+ * @to:         iterator over memory that receives the records, NULL to drop them
+ * @lengths:    array that receives the length of every record, it can be NULL
+ * @max:        maximum number of records
+ * @peek:       true if records are left in the flow
+ * 
+ * The caller holds head_mutex. Records are read back to back until @max
+ * records, the end of data or the first record that does not fit in @to.
+ * A record is never split: if it can not be copied whole, it is left in
+ * the flow.
+ * 
+ * Returns number of records read, -EMSGSIZE if the first record does not
+ * fit in @to, -EFAULT if it can not be copied.
+ */
+static int read_records(object_t *object, int priority, struct iov_iter *to, u32 *lengths, int max, bool peek)
+{
+        int nr;
+        int skip;
+        int copied;
+        u32 len;
+        struct kvec vec;
+        struct iov_iter header;
+        dynamic_buffer_t *buffer;
+
+        buffer = object->buffer[priority];
+        skip = 0;
+
+        for (nr = 0; nr < max && byte_to_read(priority,object) > skip; nr++) {
+                vec.iov_base = &len;
+                vec.iov_len = RECORD_HEADER_SIZE;
+                init_kvec_iter(&header, &vec, RECORD_HEADER_SIZE);
+                peek_dynamic_buffer(buffer, &header, skip, RECORD_HEADER_SIZE);
+
+                if (to) {
+                        if (len > iov_iter_count(to))
+                                return nr ? nr : -EMSGSIZE;
+
+                        copied = peek_dynamic_buffer(buffer, to, skip + RECORD_HEADER_SIZE, len);
+                        if (copied < len) {
+                                iov_iter_revert(to, copied);
+                                return nr ? nr : -EFAULT;
+                        }
+                }
+
+                if (lengths)
+                        lengths[nr] = len;
+
+                if (peek)
+                        skip += RECORD_HEADER_SIZE + len;
+                else
+                        sub_byte_in_buffer(priority,object,discard_dynamic_buffer(buffer, RECORD_HEADER_SIZE + len));
+        }
+
+        return nr;
+}
+
+/**
+ * stage_write - queue a write to a deferred flow for the flush
+ * @object:     I/O object of the minor
+ * @priority:   deferred flow to write
+ * @the_task:   descriptor of the staged write
+ * @segments:   list of filled data segments, it is emptied
+ * @size:       bytes of the write
+ * 
+ * The caller holds tail_mutex of the flow, so the list of staged writes
+ * keeps their order.
+ */
+static void stage_write(object_t *object, int priority, packed_work_t *the_task, struct list_head *segments, long size)
+{
+        INIT_LIST_HEAD(&(the_task->staging_area));
+        list_splice_init(segments, &(the_task->staging_area));
+        the_task->size = size;
+        the_task->priority = priority;
+
+        add_booked_byte(priority,object,size);
+
+        llist_add(&(the_task->node), &(object->staged));
+
+        // flush now once enough bytes are staged, otherwise after the delay
+        if (atomic_long_add_return(size, &(object->staged_byte)) >= READ_ONCE(flush_bytes))
+                mod_delayed_work_on(flush_target_cpu(), flush_wq, &(object->flush_work), 0);
+        else
+                queue_delayed_work_on(flush_target_cpu(), flush_wq, &(object->flush_work),
+                                msecs_to_jiffies(max(READ_ONCE(flush_delay_ms), 0)));
+}
+
+/**
+ * publish_write - wake the readers of a flow after a write
+ * @object:     I/O object of the minor
+ * @priority:   written flow
+ * @len:        bytes of the write, already accounted
+ * 
+ * The caller holds tail_mutex of the flow. In broadcast mode the write is
+ * published to cursors, and data segments no cursor needs anymore are
+ * released by the writer too.
+ */
+static void publish_write(object_t *object, int priority, long len)
+{
+        dynamic_buffer_t *buffer;
+
+        buffer = object->buffer[priority];
+
+        if (buffer->broadcast) {
+                smp_store_release(&(buffer->written), buffer->written + len);
+
+                mutex_lock(&(buffer->head_mutex));
+                sub_byte_in_buffer(priority,object,trim_cursors(buffer));
+                mutex_unlock(&(buffer->head_mutex));
+
+                wake_up_all_readers(buffer);
+        } else {
+                wake_up_readers(buffer);
+        }
+}
+
+/**
+ * dev_write_iter - write operation of driver
+ * @iocb:       I/O control block of the session to the device file
+ * @from:       iterator over data to write
+ * 
+ * All the vectors of @from are written with one lock acquisition. With
+ * IOCB_NOWAIT the operation never sleeps and returns -EAGAIN when it
+ * can not complete immediately. In record mode the write is one record,
+ * written whole or not at all.
+ * 
+ * Returns:
+ *  written bytes number when the operation is successful
+ *  a negative value when error occurs
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+        int ret;
+        int frame;
+        int byte_copied;
+        bool faulted;
+        bool stamped;
+        long booked;
+        size_t len;
+        size_t count;
+        gfp_t flags;
+        object_t *object;
+        session_t *session;
+        dynamic_buffer_t *buffer;
+        dynamic_buffer_t *shard;
+        struct mutex *tail_mutex;
+        struct list_head segments;
+        packed_work_t *the_task;
+
+        session = (session_t *)iocb->ki_filp->private_data;
+        object = session->object;
+        buffer = object->buffer[session->priority];
+        flags = is_nowait(iocb) ? GFP_ATOMIC : session->flags;
+        count = iov_iter_count(from);
+
+#ifdef DEBUG 
+        printk(KERN_INFO "%s-%d: write called\n", MODNAME, object->minor);
+#endif
+
+start:
+        len = iov_iter_count(from);
+        faulted = false;
+        stamped = false;
+        the_task = NULL;
+        frame = 0;
+
+        if (READ_ONCE(object->record)) {
+                // a record is written whole, behind a header with its length
+                if (len == 0)
+                        return 0;
+                if (len + RECORD_HEADER_SIZE > capacity(session->priority,object))
+                        return -EMSGSIZE;
+                frame = RECORD_HEADER_SIZE;
+        } else if (len > capacity(session->priority,object)) {
+                // no more than the buffer capacity can ever be written
+                len = capacity(session->priority,object);
+        }
+
+        // prepare memory areas, a ring is written in place and it needs none
+        INIT_LIST_HEAD(&segments);
+        if (!is_ring_mode(session->priority,object) &&
+                        unlikely(alloc_data_segments(&(object->pool), &segments, len + frame, flags)))
+                return -ENOMEM;
+
+        if (frame)
+                put_record_header(&segments, len);
+
+        if (buffer->deferred) {
+                the_task = kmem_cache_alloc(work_cache, flags);
+                if (unlikely(!the_task)) {
+                        free_data_segments(&(object->pool), &segments);
+                        return -ENOMEM;
+                }
+        }
+
+        // data of deferred flows and records is staged out of buffer, so it is copied without lock
+        if (buffer->deferred || frame) {
+                byte_copied = copy_segments_from_iter(&segments, from, len);
+                if (unlikely((byte_copied == 0 && len > 0) || (frame && byte_copied < len))) {
+                        ret = -EFAULT;
+                        goto free_area;
+                }
+                len = byte_copied;
+        }
+
+retry:
+        // writers of a sharded flow append to a sub-queue of it
+        shard = NULL;
+        booked = 0;
+        tail_mutex = &(buffer->tail_mutex);
+        if (session->priority == HIGH_PRIORITY && smp_load_acquire(&(object->shards))) {
+                shard = pick_shard(object);
+                tail_mutex = &(shard->tail_mutex);
+        }
+
+        ret = wait_for_space(session, tail_mutex, flags, is_nowait(iocb), len + frame);
+        if (ret <= 0)
+                goto free_area;
+
+        // record mode was selected while waiting: the write starts again with a header
+        if (unlikely(!frame && READ_ONCE(object->record))) {
+                mutex_unlock(tail_mutex);
+                free_data_segments(&(object->pool), &segments);
+                if (the_task)
+                        kmem_cache_free(work_cache, the_task);
+                iov_iter_revert(from, count - iov_iter_count(from));
+                goto start;
+        }
+
+        if (shard) {
+                // only the writes of a flow sharded by CPU need stamps for their data segments
+                if (object->ordered && !stamped) {
+                        mutex_unlock(tail_mutex);
+                        if (unlikely(stamp_data_segments(&segments, flags))) {
+                                ret = -ENOMEM;
+                                goto free_area;
+                        }
+                        stamped = true;
+                        goto retry;
+                }
+
+                // writers of other sub-queues may have taken the free space
+                booked = reserve_space(object, len);
+                if (!booked) {
+                        mutex_unlock(tail_mutex);
+                        if (is_blocking(flags) && !is_nowait(iocb))
+                                goto retry;
+                        ret = is_nowait(iocb) ? -EAGAIN : 0;
+                        goto free_area;
+                }
+                len = booked;
+        } else if (is_sharded(session->priority,object)) {
+                // sharded mode was selected while waiting
+                mutex_unlock(tail_mutex);
+                goto retry;
+        }
+
+        if (frame && len + frame > free_space(session->priority,object)) {
+                // a record is never cut
+                mutex_unlock(tail_mutex);
+                ret = is_nowait(iocb) ? -EAGAIN : 0;
+                goto free_area;
+        } else if (len > free_space(session->priority,object) + booked) {
+                len = free_space(session->priority,object) + booked;
+        }
+
+        // write data segments
+        if (!buffer->deferred) {
+                if (frame) {
+                        trim_data_segments(&(object->pool), &segments, len + frame);
+                        write_dynamic_buffer(buffer, &segments);
+                        byte_copied = len;
+                } else if (is_ring_mode(session->priority,object))
+                        byte_copied = write_ring(object->ring, from, len);
+                else if (shard)
+                        byte_copied = copy_to_dynamic_buffer(shard, &segments, from, len,
+                                        object->ordered ? ktime_get_ns() : 0);
+                else
+                        byte_copied = copy_to_dynamic_buffer(buffer, &segments, from, len, 0);
+
+                // user page is not resident: fault it in without lock and retry once
+                if (unlikely(byte_copied == 0 && len > 0)) {
+                        if (booked)
+                                atomic_long_sub(booked, &(buffer->booked_byte));
+                        mutex_unlock(tail_mutex);
+
+                        if (faulted || is_nowait(iocb) || prefault_readable(from, min_t(size_t, len, PAGE_SIZE))) {
+                                ret = is_nowait(iocb) ? -EAGAIN : -EFAULT;
+                                goto free_area;
+                        }
+                        faulted = true;
+                        goto retry;
+                }
+                len = byte_copied;
+
+                if (!is_ring_mode(session->priority,object))
+                        add_byte_in_buffer(session->priority,object,len + frame);
+
+                // the booking is released once the bytes are accounted
+                if (booked)
+                        atomic_long_sub(booked, &(buffer->booked_byte));
+
+                publish_write(object, session->priority, len);
+#ifdef DEBUG 
+                printk(KERN_INFO "%s-%d: %zu byte are written\n", MODNAME, object->minor, len);
+#endif
+        } else {
+                trim_data_segments(&(object->pool), &segments, len + frame);
+                stage_write(object, session->priority, the_task, &segments, len + frame);
+#ifdef DEBUG 
+                printk(KERN_INFO "%s-%d: %zu byte staged", MODNAME, object->minor, len);
+#endif
+        }
+
+        mutex_unlock(tail_mutex);
+
+        // the space left may cover the need of another writer
+        if (is_there_space(session->priority,object))
+                wake_up_writers(buffer);
+
+        // give back chunks not used by the write
+        free_data_segments(&(object->pool), &segments);
+
+        return len;
+
+        // goto label for manage free
+free_area:      free_data_segments(&(object->pool), &segments);
+                if (the_task)
+                        kmem_cache_free(work_cache, the_task);
+                return ret;
+}
+
+/**
+ * dev_read_iter - read operation of driver
+ * @iocb:       I/O control block of the session to the device file
+ * @to:         iterator over memory that receives read data
+ * 
+ * All the vectors of @to are filled with one lock acquisition. With
+ * IOCB_NOWAIT the operation never sleeps and returns -EAGAIN when it
+ * can not complete immediately. In record mode one whole record is read,
+ * or none if it does not fit in @to.
+ * 
+ * Returns:
+ *  read bytes number when the operation is successful
+ *  a negative value when error occurs
+ */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+        int ret;
+        bool faulted;
+        bool peek;
+        u32 length;
+        size_t len;
+        object_t *object;
+        session_t *session;
+        dynamic_buffer_t *buffer;
+
+        session = (session_t *)iocb->ki_filp->private_data;
+        object = session->object;
+        buffer = object->buffer[session->priority];
+        len = iov_iter_count(to);
+        faulted = false;
+        peek = session->peek;
+
+#ifdef DEBUG      
+        printk(KERN_INFO "%s-%d: read called\n",MODNAME,object->minor);
+#endif
+        if (session->group)
+                return dev_read_group(iocb, to);
+
+        if (session->weight)
+                return dev_read_flows(iocb, to);
+
+        if (len == 0)
+                return 0;
+
+retry:
+        // every reader of a broadcast flow has its own cursor
+        if (READ_ONCE(buffer->broadcast)) {
+                ret = subscribe_cursor(session);
+                if (ret)
+                        return ret;
+        }
+
+        ret = wait_for_data(session, is_nowait(iocb));
+        if (ret <= 0)
+                return ret;
+
+        if (buffer->broadcast && !has_cursor(session)) {
+                mutex_unlock(&(buffer->head_mutex));
+                goto retry;
+        }
+ 
+        if(len > session_to_read(session))
+                len = session_to_read(session);
+
+        if (object->record) {
+                ret = read_records(object, session->priority, to, &length, 1, peek);
+                if (ret > 0)
+                        ret = length;
+                else if (ret == -EFAULT)
+                        ret = 0;
+        } else if (peek) {
+                // only a flow made of data segments alone can be peeked
+                if (!is_plain(session->priority,object)) {
+                        mutex_unlock(&(buffer->head_mutex));
+                        session->peek = false;
+                        return -EINVAL;
+                }
+
+                ret = peek_dynamic_buffer(buffer, to, 0, len);
+        } else if (buffer->broadcast) {
+                // a reader moved on for lagging too much is told once
+                if (session->cursor->overrun) {
+                        session->cursor->overrun = false;
+                        mutex_unlock(&(buffer->head_mutex));
+                        return -EOVERFLOW;
+                }
+
+                ret = read_cursor(buffer, session->cursor, to, len);
+                sub_byte_in_buffer(session->priority,object,trim_cursors(buffer));
+        } else {
+                ret = read_flow(object, session->priority, to, len);
+        }
+
+        if (!peek)
+                wake_up_writers(buffer);
+
+        mutex_unlock(&(buffer->head_mutex));
+
+        // the data left may be for another reader
+        if (!is_empty(session->priority,object))
+                wake_up_readers(buffer);
+
+        // user page is not resident: fault it in without lock and retry once
+        if (unlikely(ret == 0)) {
+                if (faulted || is_nowait(iocb) || prefault_writeable(to, min_t(size_t, len, PAGE_SIZE)))
+                        return is_nowait(iocb) ? -EAGAIN : -EFAULT;
+                faulted = true;
+                goto retry;
+        }
+
+        // a peek holds until a read returns data
+        if (peek && ret > 0)
+                session->peek = false;
+
+#ifdef DEBUG 
+        printk(KERN_INFO "%s-%d: %d byte are read\n",MODNAME,object->minor,ret);
+#endif
+
+        return ret;
+}
+
+/**
+ * dev_read_flows - read operation of a session that reads both flows
+ * @iocb:       I/O control block of the session to the device file
+ * @to:         iterator over memory that receives read data
+ * 
+ * The high priority flow is read first. While the low priority flow
+ * holds data, it gets one byte every weight bytes of the session, so a
+ * busy high priority flow can not starve it. A share that the low
+ * priority flow can not fill goes back to the high priority one.
+ * 
+ * Returns:
+ *  read bytes number when the operation is successful
+ *  a negative value when error occurs
+ */
+static ssize_t dev_read_flows(struct kiocb *iocb, struct iov_iter *to)
+{
+        int ret;
+        int copied;
+        int to_read;
+        int read_high;
+        bool faulted;
+        long low_share;
+        long high_len;
+        long low_len;
+        size_t len;
+        object_t *object;
+        session_t *session;
+        dynamic_buffer_t *high;
+        dynamic_buffer_t *low;
+
+        session = (session_t *)iocb->ki_filp->private_data;
+        object = session->object;
+        high = object->buffer[HIGH_PRIORITY];
+        low = object->buffer[LOW_PRIORITY];
+        len = iov_iter_count(to);
+        faulted = false;
+
+        // cursors follow one flow only, records are not merged
+        if (high->broadcast || low->broadcast || object->record)
+                return -EINVAL;
+
+        if (len == 0)
+                return 0;
+
+retry:
+        ret = wait_for_flows(session, is_nowait(iocb));
+        if (ret <= 0)
+                return ret;
+
+        high_len = byte_to_read(HIGH_PRIORITY,object);
+        low_len = byte_to_read(LOW_PRIORITY,object);
+
+        if (len > high_len + low_len)
+                len = high_len + low_len;
+
+        // credit of the low priority flow, one byte every weight + 1 bytes read
+        low_share = 0;
+        if (low_len) {
+                session->low_credit += len;
+                low_share = session->low_credit / (session->weight + 1);
+                session->low_credit -= low_share * (session->weight + 1);
+        }
+
+        to_read = min_t(long, high_len, len - min(low_share, low_len));
+        ret = read_flow(object, HIGH_PRIORITY, to, to_read);
+        read_high = ret;
+
+        if (ret == to_read) {
+                to_read = min_t(long, low_len, len - ret);
+                copied = read_flow(object, LOW_PRIORITY, to, to_read);
+                ret += copied;
+
+                // the low priority flow did not fill its share
+                if (copied == to_read)
+                        ret += read_flow(object, HIGH_PRIORITY, to, min_t(long, high_len - read_high, len - ret));
+        }
+
+        wake_up_writers(high);
+        wake_up_writers(low);
+
+        mutex_unlock(&(low->head_mutex));
+        mutex_unlock(&(high->head_mutex));
+
+        // the data left may be for another reader
+        if (!is_empty(HIGH_PRIORITY,object))
+                wake_up_readers(high);
+        if (!is_empty(LOW_PRIORITY,object))
+                wake_up_readers(low);
+
+        // user page is not resident: fault it in without lock and retry once
+        if (unlikely(ret == 0)) {
+                if (faulted || is_nowait(iocb) || prefault_writeable(to, min_t(size_t, len, PAGE_SIZE)))
+                        return is_nowait(iocb) ? -EAGAIN : -EFAULT;
+                faulted = true;
+                goto retry;
+        }
+
+#ifdef DEBUG 
+        printk(KERN_INFO "%s-%d: %d byte are read from both flows\n",MODNAME,object->minor,ret);
+#endif
+
+        return ret;
+}
+
+/**
+ * dev_read_group - read operation of a session that reads a group of minors
+ * @iocb:       I/O control block of the session to the device file
+ * @to:         iterator over memory that receives read data
+ * 
+ * One read returns data of one member, the flow of the session on that
+ * minor, and GROUP_SOURCE tells which one. Members with data are served
+ * in round-robin order, each one for as many reads in a row as its
+ * weight. Reads of the same session are serialized.
+ * 
+ * Returns:
+ *  read bytes number when the operation is successful
+ *  a negative value when error occurs
+ */
+static ssize_t dev_read_group(struct kiocb *iocb, struct iov_iter *to)
+{
+        int ret;
+        bool faulted;
+        u32 length;
+        size_t len;
+        group_t *group;
+        object_t *object;
+        session_t *session;
+        dynamic_buffer_t *buffer;
+        group_member_t *member;
+
+        session = (session_t *)iocb->ki_filp->private_data;
+        group = session->group;
+        len = iov_iter_count(to);
+        faulted = false;
+
+        if (len == 0)
+                return 0;
+
+        if (is_nowait(iocb)) {
+                if (!mutex_trylock(&(group->mutex)))
+                        return -EAGAIN;
+        } else if (mutex_lock_interruptible(&(group->mutex))) {
+                return -EINTR;
+        }
+
+retry:
+        ret = wait_for_group(session, is_nowait(iocb), &member);
+        if (ret <= 0)
+                goto unlock;
+
+        object = member->object;
+        buffer = object->buffer[group->priority];
+
+        if (object->record) {
+                ret = read_records(object, group->priority, to, &length, 1, false);
+                if (ret > 0)
+                        ret = length;
+                else if (ret == -EFAULT)
+                        ret = 0;
+        } else {
+                ret = read_flow(object, group->priority, to,
+                                min_t(long, len, byte_to_read(group->priority,object)));
+        }
+
+        wake_up_writers(buffer);
+
+        mutex_unlock(&(buffer->head_mutex));
+
+        // the data left may be for another reader
+        if (!is_empty(group->priority,object))
+                wake_up_readers(buffer);
+
+        // user page is not resident: fault it in without lock and retry once
+        if (unlikely(ret == 0)) {
+                if (faulted || is_nowait(iocb) || prefault_writeable(to, min_t(size_t, len, PAGE_SIZE))) {
+                        ret = is_nowait(iocb) ? -EAGAIN : -EFAULT;
+                        goto unlock;
+                }
+                faulted = true;
+                goto retry;
+        }
+
+        if (ret < 0)
+                goto unlock;
+
+        group->last = object->minor;
+
+        // the member keeps its turn for its weight, while it has data
+        if (member != &(group->members[group->next])) {
+                group->next = member - group->members;
+                group->turns = member->weight;
+        }
+
+        if (--group->turns == 0 || is_empty(group->priority,object)) {
+                group->next = (group->next + 1) % group->count;
+                group->turns = group->members[group->next].weight;
+        }
+
+#ifdef DEBUG 
+        printk(KERN_INFO "%s-%d: %d byte are read by a group\n",MODNAME,object->minor,ret);
+#endif
+
+        // goto label for manage unlock
+unlock: mutex_unlock(&(group->mutex));
+        return ret;
+}
+
+/**
+ * dev_splice_read - move data of the flow of the session to a pipe
+ * @in:         I/O session to the device file
+ * @ppos:       file position, unused
+ * @pipe:       pipe that receives data
+ * @len:        bytes number to be moved
+ * @flags:      splice flags
+ * 
+ * The pipe receives references to the chunks of buffer, data is never
+ * copied. Flows in ring, sharded, broadcast or record mode, sessions that read
+ * both flows, a group or a peeked read, and kernels whose pipe buffers need
+ * more than get and release operations fall back to a copy, that goes
+ * through the read operation.
+ * 
+ * Returns:
+ *  moved bytes number when the operation is successful
+ *  a negative value when error occurs
+ */
+static ssize_t dev_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+        int ret;
+        bool nowait;
+        object_t *object;
+        session_t *session;
+        dynamic_buffer_t *buffer;
+
+        session = (session_t *)in->private_data;
+        object = session->object;
+        buffer = object->buffer[session->priority];
+        nowait = (flags & SPLICE_F_NONBLOCK) || (in->f_flags & O_NONBLOCK);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 8, 0)
+        return copy_splice_read(in, ppos, pipe, len, flags);
+#endif
+        if (is_ring_mode(session->priority,object) || is_sharded(session->priority,object) ||
+                        session->weight || session->group || session->peek ||
+                        buffer->broadcast || object->record)
+                return copy_splice_read(in, ppos, pipe, len, flags);
+
+        if (len == 0)
+                return 0;
+
+        ret = wait_for_data(session, nowait);
+        if (ret <= 0)
+                return ret;
+
+        if(len > byte_to_read(session->priority,object))
+                len = byte_to_read(session->priority,object);
+
+        ret = splice_dynamic_buffer(buffer, pipe, len);
+        if (ret > 0) {
+                sub_byte_in_buffer(session->priority,object,ret);
+                wake_up_writers(buffer);
+        }
+
+        mutex_unlock(&(buffer->head_mutex));
+
+        // the data left may be for another reader
+        if (!is_empty(session->priority,object))
+                wake_up_readers(buffer);
+
+#ifdef DEBUG 
+        printk(KERN_INFO "%s-%d: %d byte are spliced\n",MODNAME,object->minor,ret);
+#endif
+
+        return ret;
+}
+
+/**
+ * dev_poll - readiness of the flow of the session
+ * @filp:       I/O session to the device file
+ * @wait:       poll table
+ * 
+ * The flow is readable when it holds the read low watermark of the
+ * session and writable when it has free space, at least the write low
+ * watermark if set. For the low priority flow the free space already
+ * accounts for the booked bytes of the deferred writes. A session that
+ * reads both flows is readable when they hold the watermark together.
+ * A session that reads a group is readable when a member holds data.
+ * 
+ * Returns the mask of ready events.
+ */
+static __poll_t dev_poll(struct file *filp, poll_table *wait)
+{
+        int i;
+        int count;
+        __poll_t mask;
+        group_t *group;
+        object_t *object;
+        session_t *session;
+        dynamic_buffer_t *buffer;
+
+        session = (session_t *)filp->private_data;
+        object = session->object;
+        buffer = object->buffer[session->priority];
+        mask = 0;
+
+        poll_wait(filp, &(buffer->readers), wait);
+        poll_wait(filp, &(buffer->writers), wait);
+
+        if (session->group) {
+                group = session->group;
+                count = smp_load_acquire(&(group->count));
+
+                for (i = 1; i < count; i++)
+                        poll_wait(filp, &(group->members[i].object->buffer[session->priority]->readers), wait);
+
+                for (i = 0; i < count; i++) {
+                        if (member_ready(&(group->members[i]), session->priority))
+                                mask |= EPOLLIN | EPOLLRDNORM;
+                }
+        } else if (session->weight) {
+                // unified reads use both flows whatever the flow of the session is
+                if (session->priority != HIGH_PRIORITY)
+                        poll_wait(filp, &(object->buffer[HIGH_PRIORITY]->readers), wait);
+                if (session->priority != LOW_PRIORITY)
+                        poll_wait(filp, &(object->buffer[LOW_PRIORITY]->readers), wait);
+
+                if (byte_to_read_flows(object) >= session->read_lowat)
+                        mask |= EPOLLIN | EPOLLRDNORM;
+        } else {
+                if (buffer->broadcast && subscribe_cursor(session))
+                        return EPOLLERR;
+
+                if (session_to_read(session) >= session->read_lowat)
+                        mask |= EPOLLIN | EPOLLRDNORM;
+        }
+
+        if (free_space(session->priority,object) >= max(session->write_lowat, 1L))
+                mask |= EPOLLOUT | EPOLLWRNORM;
+
+        return mask;
+}
+
+/**
+ * dev_mmap - map the shared ring of the high priority flow
+ * @filp:       I/O session to the device file
+ * @vma:        user area to map
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int dev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+        ring_t *ring;
+
+        ring = smp_load_acquire(&(((session_t *)filp->private_data)->object->ring));
+        if (!ring)
+                return -EINVAL;
+
+        return mmap_ring(ring, vma);
+}
+
+/**
+ * dev_fsync - commit the deferred writes of the minor of a session
+ * @filp:       I/O session to the device file
+ * @start:      start of the range, unused
+ * @end:        end of the range, unused
+ * @datasync:   true if only data must be committed, unused
+ * 
+ * Returns 0.
+ */
+static int dev_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
+{
+        session_t *session;
+
+        session = (session_t *)filp->private_data;
+
+        drain_object(session->object);
+
+        return 0;
+}
+
+/**
+ * drain_object - wait until the staged writes of a minor are readable
+ * @object:     I/O object of the minor
+ * 
+ * The pending flush runs now instead of after its delay, and the caller
+ * waits for it. Every write staged before the call is then in its flow
+ * and no longer booked. Writes staged in the meantime may be left for
+ * the next flush.
+ */
+static void drain_object(object_t *object)
+{
+        flush_delayed_work(&(object->flush_work));
+
+#ifdef DEBUG 
+        printk(KERN_INFO "%s-%d: staged writes are drained\n", MODNAME, object->minor);
+#endif
+
+        return;
+}
+
+/**
+ * set_ring_mode - back the high priority flow of a minor with a shared ring
+ * @object:     I/O object of the minor
+ * 
+ * The mode can be selected only while the flow is empty, not sharded,
+ * not deferred and not in record mode, and it lasts as long as the I/O
+ * object of the minor. The ring is single producer and single consumer:
+ * processes that map it must not use it concurrently with read and
+ * write operations of the same direction.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int set_ring_mode(object_t *object)
+{
+        int ret;
+        ring_t *ring;
+        dynamic_buffer_t *buffer;
+
+        buffer = object->buffer[HIGH_PRIORITY];
+        ret = 0;
+
+        if (buffer->deferred)
+                return -EINVAL;
+
+        ring = alloc_ring();
+        if (unlikely(!ring))
+                return -ENOMEM;
+
+        // writers and readers of the flow are both excluded
+        mutex_lock(&(buffer->tail_mutex));
+        mutex_lock(&(buffer->head_mutex));
+
+        if (!object->ring) {
+                if (is_empty(HIGH_PRIORITY,object) && !object->shards && !buffer->broadcast && !object->record) {
+                        smp_store_release(&(object->ring), ring);
+                        ring = NULL;
+                } else {
+                        ret = -EBUSY;
+                }
+        }
+
+        mutex_unlock(&(buffer->head_mutex));
+        mutex_unlock(&(buffer->tail_mutex));
+
+        if (ring)
+                free_ring(ring);
+
+        return ret;
+}
+
+/**
+ * set_sharded_mode - split the high priority flow of a minor in sub-queues
+ * @object:     I/O object of the minor
+ * @mode:       SHARD_BY_WRITER or SHARD_BY_CPU
+ * 
+ * Concurrent writers append to one sub-queue per possible CPU, each with
+ * its own tail mutex, and readers merge the sub-queues. With
+ * SHARD_BY_WRITER every writer keeps its own order. With SHARD_BY_CPU the
+ * writes are stamped and read in order of write time, and small writes
+ * are coalesced in the tail chunk of their sub-queue as in the other
+ * modes, a few per chunk.
+ * 
+ * The mode can be selected only while the flow is empty, not deferred
+ * and neither in ring nor in record mode, and it lasts as long as the I/O
+ * object of the minor.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int set_sharded_mode(object_t *object, unsigned long mode)
+{
+        int i;
+        int ret;
+        dynamic_buffer_t **shards;
+        dynamic_buffer_t *buffer;
+
+        buffer = object->buffer[HIGH_PRIORITY];
+
+        if ((mode != SHARD_BY_WRITER && mode != SHARD_BY_CPU) || buffer->deferred)
+                return -EINVAL;
+
+        ret = 0;
+
+        shards = kcalloc(nr_cpu_ids, sizeof(dynamic_buffer_t *), GFP_KERNEL);
+        if (unlikely(!shards))
+                return -ENOMEM;
+
+        for (i = 0; i < nr_cpu_ids; i++) {
+                shards[i] = alloc_dynamic_buffer(&(object->pool));
+                if (unlikely(!shards[i])) {
+                        free_shards(shards, i);
+                        return -ENOMEM;
+                }
+        }
+
+        // writers and readers of the flow are both excluded
+        mutex_lock(&(buffer->tail_mutex));
+        mutex_lock(&(buffer->head_mutex));
+
+        if (!object->shards && !object->ring && !buffer->broadcast && !object->record &&
+                        is_empty(HIGH_PRIORITY,object)) {
+                object->nr_shards = nr_cpu_ids;
+                object->ordered = (mode == SHARD_BY_CPU);
+                object->next_shard = 0;
+                smp_store_release(&(object->shards), shards);
+                shards = NULL;
+        } else {
+                ret = -EBUSY;
+        }
+
+        mutex_unlock(&(buffer->head_mutex));
+        mutex_unlock(&(buffer->tail_mutex));
+
+        if (shards)
+                free_shards(shards, nr_cpu_ids);
+
+        return ret;
+}
+
+/**
+ * set_broadcast_mode - give every reader of the flow of a session its own cursor
+ * @session:    I/O session, it gets a cursor on the flow
+ * @lag_limit:  bytes a reader can lag before it is moved on, 0 if no limit
+ * 
+ * Data of a broadcast flow is read by every reader, each one from its own
+ * cursor, and data segments are freed once all cursors passed them.
+ * Without a lag limit the slowest reader holds back writers. With a lag
+ * limit, a reader that lags more is moved on and its next read fails
+ * once with -EOVERFLOW.
+ * 
+ * The mode can be selected only while the flow is empty and neither
+ * deferred, sharded, in ring nor in record mode. It lasts as long as the
+ * I/O object of the minor, later calls only change the lag limit.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int set_broadcast_mode(session_t *session, unsigned long lag_limit)
+{
+        int ret;
+        object_t *object;
+        dynamic_buffer_t *buffer;
+
+        object = session->object;
+        buffer = object->buffer[session->priority];
+        ret = 0;
+
+        if (buffer->deferred)
+                return -EINVAL;
+
+        // writers and readers of the flow are both excluded
+        mutex_lock(&(buffer->tail_mutex));
+        mutex_lock(&(buffer->head_mutex));
+
+        if (!buffer->broadcast) {
+                if (is_empty(session->priority,object) && !is_ring_mode(session->priority,object) &&
+                                !is_sharded(session->priority,object) && !object->record)
+                        WRITE_ONCE(buffer->broadcast, true);
+                else
+                        ret = -EBUSY;
+        }
+
+        if (!ret)
+                buffer->lag_limit = min_t(unsigned long, lag_limit, MAX_FLOW_CAPACITY);
+
+        mutex_unlock(&(buffer->head_mutex));
+        mutex_unlock(&(buffer->tail_mutex));
+
+        if (ret)
+                return ret;
+
+        return subscribe_cursor(session);
+}
+
+/**
+ * set_record_mode - keep the boundaries of writes on all flows of a minor
+ * @object:     I/O object of the minor
+ * 
+ * Every write becomes a record, stored in the flow behind a header with
+ * its length, so records share chunks as plain writes do. A read returns
+ * one whole record and READ_RECORDS returns many of them at once.
+ * 
+ * The mode can be selected only while all flows are empty and none is in
+ * ring, sharded or broadcast mode, and it lasts as long as the I/O object
+ * of the minor.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int set_record_mode(object_t *object)
+{
+        int ret;
+        int priority;
+        dynamic_buffer_t *buffer;
+
+        ret = 0;
+
+        // writers and readers of all flows are excluded, the subclass grows with the lock
+        // order, so the high priority head is subclass 0 as in wait_for_flows
+        for (priority = flows - 1; priority >= 0; priority--) {
+                buffer = object->buffer[priority];
+                mutex_lock_nested(&(buffer->tail_mutex), flows - 1 - priority);
+                mutex_lock_nested(&(buffer->head_mutex), flows - 1 - priority);
+        }
+
+        if (!object->record) {
+                if (is_object_empty(object) && !object->ring && !object->shards) {
+                        for (priority = 0; priority < flows; priority++)
+                                if (object->buffer[priority]->broadcast)
+                                        ret = -EBUSY;
+                } else {
+                        ret = -EBUSY;
+                }
+
+                if (!ret)
+                        WRITE_ONCE(object->record, true);
+        }
+
+        for (priority = 0; priority < flows; priority++) {
+                buffer = object->buffer[priority];
+                mutex_unlock(&(buffer->head_mutex));
+                mutex_unlock(&(buffer->tail_mutex));
+        }
+
+        return ret;
+}
+
+/**
+ * join_group - add a minor to the group read by a session
+ * @session:    I/O session
+ * @param:      user address of a group_join_t
+ * 
+ * The first call makes a group of the minor of the session and the new
+ * one, later calls add more minors. A minor already in the group only
+ * gets the new weight. Members stay in the group until the session is
+ * closed, and their I/O objects are kept until then.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int join_group(session_t *session, unsigned long param)
+{
+        int i;
+        int ret;
+        group_t *group;
+        object_t *object;
+        group_join_t join;
+
+        if (copy_from_user(&join, (void __user *)param, sizeof(group_join_t)))
+                return -EFAULT;
+
+        if (join.minor >= minors)
+                return -ENODEV;
+
+        // unified reads and cursors follow the minor of the session only
+        if (session->weight || session->cursor)
+                return -EINVAL;
+
+        join.weight = clamp_t(unsigned int, join.weight, 1, MAX_GROUP_WEIGHT);
+
+        group = READ_ONCE(session->group);
+        if (!group) {
+                group = kzalloc(sizeof(group_t), GFP_KERNEL);
+                if (unlikely(!group))
+                        return -ENOMEM;
+
+                mutex_init(&(group->mutex));
+                group->members[0].object = session->object;
+                group->members[0].group = group;
+                group->members[0].weight = 1;
+                group->count = 1;
+                group->turns = 1;
+                group->last = -1;
+
+                // another thread of the session may have made the group first
+                if (cmpxchg(&(session->group), NULL, group)) {
+                        kfree(group);
+                        group = session->group;
+                }
+        }
+
+        ret = 0;
+
+        mutex_lock(&(group->mutex));
+
+        for (i = 0; i < group->count; i++) {
+                if (group->members[i].object->minor == join.minor) {
+                        group->members[i].weight = join.weight;
+                        goto unlock;
+                }
+        }
+
+        if (group->count == GROUP_MAX_MEMBERS) {
+                ret = -ENOSPC;
+                goto unlock;
+        }
+
+        object = get_object(join.minor);
+        if (IS_ERR(object)) {
+                ret = PTR_ERR(object);
+                goto unlock;
+        }
+
+        group->members[i].object = object;
+        group->members[i].group = group;
+        group->members[i].weight = join.weight;
+
+        // pairs with the poll operation, that does not take the mutex
+        smp_store_release(&(group->count), i + 1);
+
+        // goto label for manage unlock
+unlock: mutex_unlock(&(group->mutex));
+        return ret;
+}
+
+/**
+ * free_group - free the group of a closed session
+ * @group:      minors read by the session
+ * 
+ * The I/O object of the first member is the one of the session, it is
+ * released with the session.
+ */
+static void free_group(group_t *group)
+{
+        int i;
+
+        for (i = 1; i < group->count; i++)
+                put_object(group->members[i].object);
+
+        kfree(group);
+
+        return;
+}
+
+/**
+ * discard_flow - drop data of the flow of a session without copying it
+ * @session:    I/O session
+ * @len:        bytes to drop, records in record mode
+ * 
+ * Only the data already in the flow is dropped, the operation never
+ * waits for data. Fully dropped chunks go back to the pool.
+ * 
+ * Returns number of dropped bytes, otherwise a negative value.
+ */
+static long discard_flow(session_t *session, unsigned long len)
+{
+        int ret;
+        object_t *object;
+        dynamic_buffer_t *buffer;
+
+        object = session->object;
+        buffer = object->buffer[session->priority];
+
+        if (mutex_lock_interruptible(&(buffer->head_mutex)))
+                return -EINTR;
+
+        if (!is_plain(session->priority,object)) {
+                mutex_unlock(&(buffer->head_mutex));
+                return -EINVAL;
+        }
+
+        if (object->record) {
+                ret = read_records(object, session->priority, NULL, NULL, min_t(unsigned long, len, INT_MAX), false);
+        } else {
+                len = min_t(unsigned long, len, byte_to_read(session->priority,object));
+
+                ret = discard_dynamic_buffer(buffer, len);
+                sub_byte_in_buffer(session->priority,object,ret);
+        }
+
+        mutex_unlock(&(buffer->head_mutex));
+
+        if (ret)
+                wake_up_writers(buffer);
+
+#ifdef DEBUG 
+        printk(KERN_INFO "%s-%d: %d byte are discarded\n",MODNAME,object->minor,ret);
+#endif
+
+        return ret;
+}
+
+/**
+ * read_record_batch - read many records of the flow of a session at once
+ * @session:    I/O session
+ * @param:      user address of a record_batch_t
+ * 
+ * The operation waits for data as a read of the session does, then it
+ * fills the user area with whole records, back to back, and the lengths
+ * array with their lengths, up to count records.
+ * 
+ * Returns number of records read, otherwise a negative value.
+ */
+static long read_record_batch(session_t *session, unsigned long param)
+{
+        int ret;
+        bool faulted;
+        u32 lengths[RECORD_BATCH_MAX];
+        object_t *object;
+        dynamic_buffer_t *buffer;
+        record_batch_t batch;
+        record_batch_t __user *user_batch;
+        struct iovec iov;
+        struct iov_iter to;
+
+        object = session->object;
+        buffer = object->buffer[session->priority];
+        user_batch = (record_batch_t __user *)param;
+        faulted = false;
+
+        if (!READ_ONCE(object->record))
+                return -EINVAL;
+
+        if (copy_from_user(&batch, user_batch, sizeof(record_batch_t)))
+                return -EFAULT;
+
+        if (batch.count == 0 || batch.size == 0)
+                return 0;
+
+        batch.count = min_t(unsigned int, batch.count, RECORD_BATCH_MAX);
+        batch.size = min_t(unsigned long, batch.size, MAX_FLOW_CAPACITY);
+
+retry:
+        iov.iov_base = batch.buffer;
+        iov.iov_len = batch.size;
+        iov_iter_init(&to, READ, &iov, 1, batch.size);
+
+        ret = wait_for_data(session, false);
+        if (ret <= 0)
+                return ret;
+
+        ret = read_records(object, session->priority, &to, lengths, batch.count, false);
+        if (ret > 0)
+                wake_up_writers(buffer);
+
+        mutex_unlock(&(buffer->head_mutex));
+
+        // the data left may be for another reader
+        if (!is_empty(session->priority,object))
+                wake_up_readers(buffer);
+
+        // user page is not resident: fault it in without lock and retry once
+        if (unlikely(ret == -EFAULT)) {
+                if (faulted || prefault_writeable(&to, min_t(size_t, batch.size, PAGE_SIZE)))
+                        return -EFAULT;
+                faulted = true;
+                goto retry;
+        }
+
+        if (ret < 0)
+                return ret;
+
+        if (copy_to_user(batch.lengths, lengths, ret * sizeof(u32)) || put_user(ret, &(user_batch->count)))
+                return -EFAULT;
+
+#ifdef DEBUG 
+        printk(KERN_INFO "%s-%d: %d records are read\n",MODNAME,object->minor,ret);
+#endif
+
+        return ret;
+}
+
+/**
+ * stage_payload - copy the payload of a SUBMIT entry from user
+ * @entry:      entry of the batch
+ * @segments:   empty list that receives the data segments of payload
+ * 
+ * Returns bytes of payload, otherwise a negative value.
+ */
+static long stage_payload(submit_entry_t *entry, struct list_head *segments)
+{
+        long ret;
+        long len;
+        struct iovec iovstack[UIO_FASTIOV];
+        struct iovec *iov;
+        struct iov_iter from;
+
+        iov = iovstack;
+
+        ret = import_iovec(WRITE, entry->iov, entry->iovcnt, UIO_FASTIOV, &iov, &from);
+        if (ret < 0)
+                return ret;
+
+        len = iov_iter_count(&from);
+        if (len > MAX_FLOW_CAPACITY) {
+                ret = -EMSGSIZE;
+                goto free_iov;
+        }
+
+        ret = alloc_data_segments(&submit_pool, segments, len, GFP_KERNEL);
+        if (unlikely(ret))
+                goto free_iov;
+
+        if (copy_segments_from_iter(segments, &from, len) < len) {
+                free_data_segments(&submit_pool, segments);
+                ret = -EFAULT;
+                goto free_iov;
+        }
+
+        ret = len;
+
+        // goto label for manage free
+free_iov:       kfree(iov);
+                return ret;
+}
+
+/**
+ * submit_entry - write a shared payload to the flow of a minor
+ * @object:     I/O object of the minor
+ * @priority:   flow to write
+ * @payload:    payload of the write
+ * 
+ * The data segments of the flow reference the chunks of @payload. The
+ * write never waits: it is written whole or fails with -EAGAIN. Flows in
+ * ring or sharded mode are not written, they fail with -EINVAL.
+ * 
+ * Returns written bytes number, otherwise a negative value.
+ */
+static long submit_entry(object_t *object, int priority, submit_payload_t *payload)
+{
+        long ret;
+        int frame;
+        packed_work_t *the_task;
+        dynamic_buffer_t *buffer;
+        struct list_head segments;
+
+        buffer = object->buffer[priority];
+
+        if (payload->size == 0)
+                return 0;
+
+retry:
+        frame = READ_ONCE(object->record) ? RECORD_HEADER_SIZE : 0;
+        the_task = NULL;
+
+        // a record gets its own header, then the shared chunks
+        INIT_LIST_HEAD(&segments);
+        if (frame) {
+                if (unlikely(alloc_data_segments(&(object->pool), &segments, frame, GFP_KERNEL)))
+                        return -ENOMEM;
+                put_record_header(&segments, payload->size);
+        }
+
+        if (unlikely(share_data_segments(&(object->pool), &segments, &(payload->segments), GFP_KERNEL))) {
+                free_data_segments(&(object->pool), &segments);
+                return -ENOMEM;
+        }
+
+        if (buffer->deferred) {
+                the_task = kmem_cache_alloc(work_cache, GFP_KERNEL);
+                if (unlikely(!the_task)) {
+                        free_data_segments(&(object->pool), &segments);
+                        return -ENOMEM;
+                }
+        }
+
+        mutex_lock(&(buffer->tail_mutex));
+
+        if (is_ring_mode(priority,object) || is_sharded(priority,object)) {
+                ret = -EINVAL;
+                goto unlock;
+        }
+
+        // record mode was selected in the meantime
+        if (unlikely(!frame && object->record)) {
+                mutex_unlock(&(buffer->tail_mutex));
+                free_data_segments(&(object->pool), &segments);
+                if (the_task)
+                        kmem_cache_free(work_cache, the_task);
+                goto retry;
+        }
+
+        if (payload->size + frame > capacity(priority,object)) {
+                ret = -EMSGSIZE;
+                goto unlock;
+        }
+
+        if (payload->size + frame > free_space(priority,object)) {
+                ret = -EAGAIN;
+                goto unlock;
+        }
+
+        if (!buffer->deferred) {
+                write_dynamic_buffer(buffer, &segments);
+                add_byte_in_buffer(priority,object,payload->size + frame);
+                publish_write(object, priority, payload->size);
+        } else {
+                stage_write(object, priority, the_task, &segments, payload->size + frame);
+                the_task = NULL;
+        }
+
+        ret = payload->size;
+
+        // goto label for manage unlock and free
+unlock: mutex_unlock(&(buffer->tail_mutex));
+        free_data_segments(&(object->pool), &segments);
+        if (the_task)
+                kmem_cache_free(work_cache, the_task);
+        return ret;
+}
+
+/**
+ * submit_batch - write many payloads to many minors at once
+ * @param:      user address of a submit_batch_t
+ * 
+ * Entries that point to the same vectors share one payload: it is copied
+ * from user once, and the flows of all its entries reference the same
+ * chunks. Every entry is written whole or not at all, without waiting,
+ * and gets its own result: written bytes number or a negative value.
+ * The I/O object of a minor is taken by its first entry and released
+ * after the whole batch.
+ * 
+ * Returns number of written entries, otherwise a negative value.
+ */
+static long submit_batch(unsigned long param)
+{
+        int i;
+        int j;
+        long ret;
+        int k;
+        long *results;
+        object_t **objects;
+        submit_batch_t batch;
+        submit_entry_t *entries;
+        submit_payload_t *payloads;
+
+        if (copy_from_user(&batch, (void __user *)param, sizeof(submit_batch_t)))
+                return -EFAULT;
+
+        if (batch.count == 0)
+                return 0;
+
+        if (batch.count > SUBMIT_BATCH_MAX)
+                return -EINVAL;
+
+        entries = memdup_user(batch.entries, batch.count * sizeof(submit_entry_t));
+        if (IS_ERR(entries))
+                return PTR_ERR(entries);
+
+        ret = -ENOMEM;
+
+        results = kcalloc(batch.count, sizeof(long), GFP_KERNEL);
+        if (unlikely(!results))
+                goto free_entries;
+
+        payloads = kcalloc(batch.count, sizeof(submit_payload_t), GFP_KERNEL);
+        if (unlikely(!payloads))
+                goto free_results;
+
+        objects = kcalloc(batch.count, sizeof(object_t *), GFP_KERNEL);
+        if (unlikely(!objects)) {
+                kfree(payloads);
+                goto free_results;
+        }
+
+        for (i = 0; i < batch.count; i++)
+                INIT_LIST_HEAD(&(payloads[i].segments));
+
+        ret = 0;
+
+        for (i = 0; i < batch.count; i++) {
+                // the payload is copied by the first entry that points to it
+                for (j = 0; j < i; j++)
+                        if (entries[j].iov == entries[i].iov && entries[j].iovcnt == entries[i].iovcnt)
+                                break;
+
+                if (j == i)
+                        payloads[i].size = stage_payload(&entries[i], &(payloads[i].segments));
+
+                results[i] = payloads[j].size;
+                if (results[i] < 0)
+                        continue;
+
+                if (entries[i].minor >= minors) {
+                        results[i] = -ENODEV;
+                        continue;
+                }
+
+                if (entries[i].flow >= flows) {
+                        results[i] = -EINVAL;
+                        continue;
+                }
+
+                // the object is taken by the first entry that writes to the minor
+                for (k = 0; k < i; k++)
+                        if (objects[k] && entries[k].minor == entries[i].minor)
+                                break;
+
+                if (k == i) {
+                        objects[i] = get_object(entries[i].minor);
+                        if (IS_ERR(objects[i])) {
+                                results[i] = PTR_ERR(objects[i]);
+                                objects[i] = NULL;
+                                continue;
+                        }
+                }
+
+                results[i] = submit_entry(objects[k], entries[i].flow, &payloads[j]);
+
+                if (results[i] >= 0)
+                        ret++;
+        }
+
+        if (copy_to_user(batch.results, results, batch.count * sizeof(long)))
+                ret = -EFAULT;
+
+#ifdef DEBUG 
+        printk(KERN_INFO "%s: %ld of %u submitted writes are done\n", MODNAME, ret, batch.count);
+#endif
+
+        for (i = 0; i < batch.count; i++)
+                if (objects[i])
+                        put_object(objects[i]);
+
+        // chunks still referenced by flows are released by them
+        for (i = 0; i < batch.count; i++)
+                free_data_segments(&submit_pool, &(payloads[i].segments));
+
+        kfree(objects);
+        kfree(payloads);
+
+        // goto label for manage free
+free_results:   kfree(results);
+free_entries:   kfree(entries);
+                return ret;
 }
 
 /**
@@ -371,18 +3001,26 @@ static ssize_t dev_read(struct file *filp, char *buff, size_t len, loff_t *off)
  * @command:    requested ioctl command
  * @param:      optional parameter
  * 
- * Returns 0 if the operation is successful, otherwise a negative value.
+ * Returns 0 if the operation is successful, the number of dropped bytes
+ * or records for DISCARD, the number of read records for READ_RECORDS,
+ * the minor of the last read for GROUP_SOURCE, otherwise a negative value.
  */
 static ssize_t dev_ioctl(struct file *filp, unsigned int command, unsigned long param)
 {
         session_t *session = (session_t *)filp->private_data;
+        struct timespec64 deadline;
 
         switch (command) {
         case TO_HIGH_PRIORITY:
-                session->priority = HIGH_PRIORITY;
+                set_session_priority(session, HIGH_PRIORITY);
                 break;
         case TO_LOW_PRIORITY:
-                session->priority = LOW_PRIORITY;
+                set_session_priority(session, LOW_PRIORITY);
+                break;
+        case SET_PRIORITY:
+                if (param >= flows)
+                        return -EINVAL;
+                set_session_priority(session, param);
                 break;
         case BLOCK:
                 session->flags = GFP_KERNEL;
@@ -391,59 +3029,561 @@ static ssize_t dev_ioctl(struct file *filp, unsigned int command, unsigned long
                 session->flags = GFP_ATOMIC;
                 break;
         case TIMEOUT:
-                session->flags = GFP_ATOMIC;
-                session->timeout = get_seconds(param);
+                session->flags = GFP_KERNEL;
+                session->timeout = ktime_set(get_seconds(param), 0);
+                break;
+        case TIMEOUT_USEC:
+                session->flags = GFP_KERNEL;
+                session->timeout = get_nanoseconds(param, NSEC_PER_USEC);
+                break;
+        case TIMEOUT_NSEC:
+                session->flags = GFP_KERNEL;
+                session->timeout = get_nanoseconds(param, 1);
+                break;
+        case DEADLINE:
+                if (get_timespec64(&deadline, (void __user *)param))
+                        return -EFAULT;
+                if (!timespec64_valid(&deadline))
+                        return -EINVAL;
+                session->flags = GFP_KERNEL;
+                session->deadline = timespec64_to_ktime(deadline);
+                break;
+        case READ_LOWAT:
+                session->read_lowat = clamp_t(long, param, 1, MAX_FLOW_CAPACITY);
                 break;
+        case WRITE_LOWAT:
+                session->write_lowat = clamp_t(long, param, 0, MAX_FLOW_CAPACITY);
+                break;
+        case BUSY_POLL:
+                session->busy_poll_max = (u64)min_t(unsigned long, param, MAX_BUSY_POLL_USEC) * NSEC_PER_USEC;
+                session->busy_poll_cur = session->busy_poll_max;
+                break;
+        case RING_MODE:
+                return set_ring_mode(session->object);
+        case UNIFIED_READ:
+                if (session->group)
+                        return -EINVAL;
+                session->weight = min_t(unsigned long, param, MAX_READ_WEIGHT);
+                session->low_credit = 0;
+                session->peek = false;
+                break;
+        case PEEK:
+                if (session->weight || session->group)
+                        return -EINVAL;
+                session->peek = true;
+                break;
+        case DISCARD:
+                return discard_flow(session, param);
+        case DRAIN:
+                drain_object(session->object);
+                break;
+        case BROADCAST_MODE:
+                if (session->group)
+                        return -EINVAL;
+                return set_broadcast_mode(session, param);
+        case RECORD_MODE:
+                return set_record_mode(session->object);
+        case READ_RECORDS:
+                return read_record_batch(session, param);
+        case GROUP_JOIN:
+                return join_group(session, param);
+        case GROUP_SOURCE:
+                if (!session->group)
+                        return -EINVAL;
+                return session->group->last < 0 ? -ENODATA : session->group->last;
+        case SHARDED_MODE:
+                return set_sharded_mode(session->object, param);
+        case RING_NOTIFY:
+                wake_up_readers(session->object->buffer[HIGH_PRIORITY]);
+                wake_up_writers(session->object->buffer[HIGH_PRIORITY]);
+                break;
+        default:
+                return -ENOTTY;
+        }
+
+        return 0;
+}
+
+/**
+ * ctl_ioctl - manager of I/O control requests of the control node
+ * @filp:       I/O session to the control node
+ * @command:    requested ioctl command
+ * @param:      optional parameter
+ * 
+ * Returns the number of written entries for SUBMIT, otherwise a negative
+ * value.
+ */
+static long ctl_ioctl(struct file *filp, unsigned int command, unsigned long param)
+{
+        switch (command) {
+        case SUBMIT:
+                return submit_batch(param);
         default:
                 return -ENOTTY;
         }
+}
+
+/**
+ * parse_enabled - enable or disable minors
+ * @val:        comma separated Y or N flags, from minor 0
+ * 
+ * Minors not listed keep their flag. The caller holds devices_mutex and
+ * the table of flags exists.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int parse_enabled(const char *val)
+{
+        int i;
+        int ret;
+        bool flag;
+        char *copy;
+        char *cur;
+        char *token;
+
+        copy = kstrdup(val, GFP_KERNEL);
+        if (unlikely(!copy))
+                return -ENOMEM;
+
+        cur = strim(copy);
+        ret = 0;
+
+        for (i = 0; cur && i < minors; i++) {
+                token = strsep(&cur, ",");
+
+                ret = kstrtobool(token, &flag);
+                if (ret)
+                        break;
+
+                enabled[i] = flag;
+        }
+
+        kfree(copy);
+
+        return ret;
+}
+
+/**
+ * enabled_set - enable or disable minors
+ * @val:        comma separated Y or N flags, from minor 0
+ * @kp:         kernel parameter
+ * 
+ * At load time the number of minors is not known yet, so the flags are
+ * kept and applied by init_module.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int enabled_set(const char *val, const struct kernel_param *kp)
+{
+        int ret;
+        char *copy;
+
+        ret = 0;
+
+        mutex_lock(&devices_mutex);
+
+        if (!enabled) {
+                copy = kstrdup(val, GFP_KERNEL);
+                if (unlikely(!copy)) {
+                        ret = -ENOMEM;
+                        goto unlock;
+                }
+                kfree(enabled_at_load);
+                enabled_at_load = copy;
+        } else {
+                ret = parse_enabled(val);
+        }
+
+unlock:
+        mutex_unlock(&devices_mutex);
+
+        return ret;
+}
+
+/**
+ * enabled_get - print enabled flag of all minors
+ * @buffer:     page to fill
+ * @kp:         kernel parameter
+ * 
+ * Values are comma separated, as done for module_param_array.
+ * 
+ * Returns number of characters written.
+ */
+static int enabled_get(char *buffer, const struct kernel_param *kp)
+{
+        int i;
+        int off;
+
+        off = 0;
+
+        mutex_lock(&devices_mutex);
+
+        for (i = 0; enabled && i < minors; i++)
+                off += scnprintf(buffer + off, PAGE_SIZE - off, "%s%c", i ? "," : "", enabled[i] ? 'Y' : 'N');
+
+        mutex_unlock(&devices_mutex);
+
+        off += scnprintf(buffer + off, PAGE_SIZE - off, "\n");
+
+        return off;
+}
+
+/**
+ * read_only_set - the per flow counters are read only
+ * @val:        value to set
+ * @kp:         kernel parameter
+ * 
+ * Returns -EPERM.
+ */
+static int read_only_set(const char *val, const struct kernel_param *kp)
+{
+        return -EPERM;
+}
+
+/**
+ * byte_in_buffer_of - number of bytes of a flow
+ * @object:     I/O object of the minor
+ * @priority:   priority of the flow
+ * 
+ * Returns number of bytes to read, the flow in ring mode is counted
+ * from the shared indexes.
+ */
+static long byte_in_buffer_of(object_t *object, int priority)
+{
+        return byte_to_read(priority,object);
+}
+
+/**
+ * thread_in_wait_of - number of threads waiting on a flow
+ * @object:     I/O object of the minor
+ * @priority:   priority of the flow
+ * 
+ * Returns number of waiting threads.
+ */
+static long thread_in_wait_of(object_t *object, int priority)
+{
+        return atomic_long_read(&(object->buffer[priority]->thread_in_wait));
+}
+
+/**
+ * snapshot_flows - read a counter of all flows at once
+ * @counter:    function that reads the counter of a flow
+ * 
+ * The counters are read in one pass under devices_mutex, the flows of a
+ * minor one after the other. The flow of minor m with priority p is at
+ * index p * minors + m, as done for module_param_array.
+ * 
+ * Returns pointer to the values, to free with kfree, NULL if allocation
+ * fails.
+ */
+static long *snapshot_flows(long (*counter)(object_t *, int))
+{
+        int i;
+        int priority;
+        long *values;
+        object_t *object;
+
+        values = kmalloc_array(flows * minors, sizeof(long), GFP_KERNEL);
+        if (unlikely(!values))
+                return NULL;
+
+        mutex_lock(&devices_mutex);
+
+        for (i = 0; i < minors; i++) {
+                object = devices ? devices[i] : NULL;
+
+                for (priority = 0; priority < flows; priority++)
+                        values[priority * minors + i] = object ? counter(object, priority) : 0;
+        }
+
+        mutex_unlock(&devices_mutex);
+
+        return values;
+}
+
+/**
+ * print_flows - print a counter of all flows in a module parameter page
+ * @buffer:     page to fill
+ * @counter:    function that reads the counter of a flow
+ * 
+ * Values are comma separated, flows of priority 0 first. A view that
+ * does not fit in one page is not cut: it fails, and the debugfs file
+ * of the same counter holds it whole.
+ * 
+ * Returns number of characters written, otherwise a negative value.
+ */
+static int print_flows(char *buffer, long (*counter)(object_t *, int))
+{
+        int i;
+        int off;
+        long *values;
+
+        values = snapshot_flows(counter);
+        if (unlikely(!values))
+                return -ENOMEM;
+
+        off = 0;
+
+        for (i = 0; i < flows * minors && off < PAGE_SIZE; i++)
+                off += snprintf(buffer + off, PAGE_SIZE - off, "%s%ld", i ? "," : "", values[i]);
+
+        if (off < PAGE_SIZE)
+                off += snprintf(buffer + off, PAGE_SIZE - off, "\n");
+
+        kfree(values);
+
+        return off < PAGE_SIZE ? off : -EOVERFLOW;
+}
+
+/**
+ * byte_in_buffer_get - print number of bytes of all flows
+ * @buffer:     page to fill
+ * @kp:         kernel parameter
+ * 
+ * Returns number of characters written, otherwise a negative value.
+ */
+static int byte_in_buffer_get(char *buffer, const struct kernel_param *kp)
+{
+        return print_flows(buffer, byte_in_buffer_of);
+}
+
+/**
+ * thread_in_wait_get - print number of waiting threads of all flows
+ * @buffer:     page to fill
+ * @kp:         kernel parameter
+ * 
+ * Returns number of characters written, otherwise a negative value.
+ */
+static int thread_in_wait_get(char *buffer, const struct kernel_param *kp)
+{
+        return print_flows(buffer, thread_in_wait_of);
+}
+
+/**
+ * render_flows - print a counter of all flows in a debugfs file
+ * @m:          seq_file of the view
+ * @counter:    function that reads the counter of a flow
+ * 
+ * As print_flows, with no bound on the length of the view.
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int render_flows(struct seq_file *m, long (*counter)(object_t *, int))
+{
+        int i;
+        long *values;
+
+        values = snapshot_flows(counter);
+        if (unlikely(!values))
+                return -ENOMEM;
+
+        for (i = 0; i < flows * minors; i++)
+                seq_printf(m, "%s%ld", i ? "," : "", values[i]);
+
+        seq_putc(m, '\n');
+
+        kfree(values);
 
         return 0;
 }
 
+/**
+ * byte_in_buffer_show - print number of bytes of all flows
+ * @m:          seq_file of the view
+ * @v:          iterator, unused
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int byte_in_buffer_show(struct seq_file *m, void *v)
+{
+        return render_flows(m, byte_in_buffer_of);
+}
+
+/**
+ * thread_in_wait_show - print number of waiting threads of all flows
+ * @m:          seq_file of the view
+ * @v:          iterator, unused
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int thread_in_wait_show(struct seq_file *m, void *v)
+{
+        return render_flows(m, thread_in_wait_of);
+}
+
+/**
+ * byte_in_buffer_open - open the view of the bytes of all flows
+ * @inode:      debugfs inode of the view
+ * @file:       session to the view
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int byte_in_buffer_open(struct inode *inode, struct file *file)
+{
+        return single_open(file, byte_in_buffer_show, NULL);
+}
+
+/**
+ * thread_in_wait_open - open the view of the waiting threads of all flows
+ * @inode:      debugfs inode of the view
+ * @file:       session to the view
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+static int thread_in_wait_open(struct inode *inode, struct file *file)
+{
+        return single_open(file, thread_in_wait_show, NULL);
+}
+
 /**
  * init_module - module initialization 
  * 
+ * Only the table of minors is allocated here, the I/O object of each
+ * minor is allocated by its first session. A device node is created
+ * for every minor.
+ * 
  * Returns 0 if the operation is successful, otherwise a negative value.
  */
 int init_module(void)
 {
         int i;
+        int ret;
+        struct device *node;
+
+        // the control node takes the minor after the last one, the enabled flags one page
+        if (minors < 1 || minors >= MAX_MINOR_NUMBER || minors > MAX_ENABLED_MINORS) {
+                printk(KERN_INFO "%s: minors must be between 1 and %lu\n", MODNAME,
+                                min_t(unsigned long, MAX_MINOR_NUMBER - 1, MAX_ENABLED_MINORS));
+                ret = -EINVAL;
+                goto free_tables;
+        }
 
-        Major = __register_chrdev(0, 0, MINOR_NUMBER, DEVICE_NAME, &fops);
+        if (flows < FLOWS || flows > MAX_FLOWS) {
+                printk(KERN_INFO "%s: flows must be between %d and %d\n", MODNAME, FLOWS, MAX_FLOWS);
+                ret = -EINVAL;
+                goto free_tables;
+        }
 
-        if (Major < 0) {
-                printk(KERN_INFO "%s: registering device failed\n",MODNAME);
-                return Major;
+        // flows without a capacity take the default one
+        for (i = 0; i < flows; i++) {
+                if (flow_capacity[i] == 0)
+                        flow_capacity[i] = MAX_BYTE_IN_BUFFER;
+
+                if (flow_capacity[i] < CHUNK_SIZE || flow_capacity[i] > MAX_FLOW_CAPACITY) {
+                        printk(KERN_INFO "%s: flow capacity must be between %lu and %d\n", MODNAME, CHUNK_SIZE, MAX_FLOW_CAPACITY);
+                        ret = -EINVAL;
+                        goto free_tables;
+                }
         }
 
-        // setup of structures
-        for (i = 0; i < MINOR_NUMBER; i++) {
-                devices[i].workqueue = create_singlethread_workqueue("work-queue-" + i);
+        // setup of minors table
+        devices = vzalloc(minors * sizeof(object_t *));
+        enabled = vmalloc(minors * sizeof(bool));
+        if (unlikely(!devices || !enabled)) {
+                ret = -ENOMEM;
+                goto free_tables;
+        }
 
-                devices[i].buffer[LOW_PRIORITY] = kmalloc(sizeof(dynamic_buffer_t), GFP_KERNEL);
-                devices[i].buffer[HIGH_PRIORITY] = kmalloc(sizeof(dynamic_buffer_t), GFP_KERNEL);
+        memset(enabled, true, minors * sizeof(bool));
 
-                if (unlikely(!devices[i].buffer[LOW_PRIORITY] || !devices[i].buffer[HIGH_PRIORITY]))
-                        break;
+        // flags given at load time wait for the table
+        if (enabled_at_load) {
+                mutex_lock(&devices_mutex);
+                ret = parse_enabled(enabled_at_load);
+                mutex_unlock(&devices_mutex);
 
-                init_dynamic_buffer(devices[i].buffer[LOW_PRIORITY]);
-                init_dynamic_buffer(devices[i].buffer[HIGH_PRIORITY]);
+                kfree(enabled_at_load);
+                enabled_at_load = NULL;
+
+                if (ret) {
+                        printk(KERN_INFO "%s: enabled must be a list of Y or N flags\n", MODNAME);
+                        goto free_tables;
+                }
+        }
+
+        init_chunk_pool(&submit_pool);
+
+        // setup of caches
+        if (init_buffer_caches()) {
+                ret = -ENOMEM;
+                goto free_tables;
+        }
+
+        object_cache = kmem_cache_create("multi-flow-object", sizeof(object_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+        if (unlikely(!object_cache)) {
+                ret = -ENOMEM;
+                goto destroy_buffer_caches;
+        }
+
+        work_cache = kmem_cache_create("multi-flow-work", sizeof(packed_work_t), 0, SLAB_HWCACHE_ALIGN, NULL);
+        if (unlikely(!work_cache)) {
+                ret = -ENOMEM;
+                goto destroy_object_cache;
+        }
+
+        // one workqueue serves the flushes of all minors
+        flush_wq = alloc_workqueue("multi-flow-flush",
+                        (flush_cpu < 0 ? WQ_UNBOUND : 0) | (flush_highpri ? WQ_HIGHPRI : 0), 0);
+        if (unlikely(!flush_wq)) {
+                ret = -ENOMEM;
+                goto destroy_work_cache;
+        }
+
+        device_class = create_device_class(CLASS_NAME);
+        if (IS_ERR(device_class)) {
+                ret = PTR_ERR(device_class);
+                goto destroy_workqueue;
         }
 
-        if (i < MINOR_NUMBER) {
-                for (; i > -1; i--) {
-                        destroy_workqueue(devices[i].workqueue);
+        // the control node takes the minor after the last one
+        Major = __register_chrdev(0, 0, minors + 1, DEVICE_NAME, &fops);
+
+        if (Major < 0) {
+                printk(KERN_INFO "%s: registering device failed\n",MODNAME);
+                ret = Major;
+                goto destroy_class;
+        }
 
-                        free_dynamic_buffer(devices[i].buffer[LOW_PRIORITY]);
-                        free_dynamic_buffer(devices[i].buffer[HIGH_PRIORITY]);
+        // setup of device nodes
+        for (i = 0; i < minors; i++) {
+                node = device_create(device_class, NULL, MKDEV(Major, i), NULL, NODE_NAME, i);
+                if (IS_ERR(node)) {
+                        ret = PTR_ERR(node);
+                        goto destroy_nodes;
                 }
-                return -ENOMEM;
         }
 
+        node = device_create(device_class, NULL, MKDEV(Major, minors), NULL, CONTROL_NODE_NAME);
+        if (IS_ERR(node)) {
+                ret = PTR_ERR(node);
+                goto destroy_nodes;
+        }
+
+        // the views are optional, the device works without debugfs
+        debug_dir = debugfs_create_dir(CLASS_NAME, NULL);
+        debugfs_create_file("byte_in_buffer", S_IRUSR | S_IRGRP, debug_dir, NULL, &byte_in_buffer_fops);
+        debugfs_create_file("thread_in_wait", S_IRUSR | S_IRGRP, debug_dir, NULL, &thread_in_wait_fops);
+
         printk(KERN_INFO "%s: new device registered, it is assigned major number %d\n",MODNAME, Major);
 
         return 0;
+
+        // goto label for manage cleanup
+destroy_nodes:          for (i--; i > -1; i--)
+                                device_destroy(device_class, MKDEV(Major, i));
+                        __unregister_chrdev(Major, 0, minors + 1, DEVICE_NAME);
+destroy_class:          class_destroy(device_class);
+destroy_workqueue:      destroy_workqueue(flush_wq);
+destroy_work_cache:     kmem_cache_destroy(work_cache);
+destroy_object_cache:   kmem_cache_destroy(object_cache);
+destroy_buffer_caches:  destroy_buffer_caches();
+free_tables:            vfree(devices);
+                        vfree(enabled);
+                        kfree(enabled_at_load);
+                        devices = NULL;
+                        enabled = NULL;
+                        enabled_at_load = NULL;
+                        return ret;
 }
 
 /**
@@ -454,15 +3594,41 @@ void cleanup_module(void)
 {
         int i;
 
-        // deallocation of structures
-        for (i = 0; i < MINOR_NUMBER; i++) {
-                destroy_workqueue(devices[i].workqueue);
+        debugfs_remove_recursive(debug_dir);
 
-                free_dynamic_buffer(devices[i].buffer[LOW_PRIORITY]);
-                free_dynamic_buffer(devices[i].buffer[HIGH_PRIORITY]);
-        }
+        for (i = 0; i <= minors; i++)
+                device_destroy(device_class, MKDEV(Major, i));
+
+        class_destroy(device_class);
+
+        __unregister_chrdev(Major, 0, minors + 1, DEVICE_NAME);
+
+        // a pending flush may still wait for its delay
+        for (i = 0; i < minors; i++)
+                if (devices[i])
+                        flush_delayed_work(&(devices[i]->flush_work));
+
+        destroy_workqueue(flush_wq);
+
+        // deallocation of structures, module parameters may still be read
+        mutex_lock(&devices_mutex);
+
+        for (i = 0; i < minors; i++)
+                if (devices[i])
+                        free_object(devices[i]);
+
+        vfree(devices);
+        vfree(enabled);
+        devices = NULL;
+        enabled = NULL;
+
+        mutex_unlock(&devices_mutex);
+
+        free_chunk_pool(&submit_pool);
 
-        unregister_chrdev(Major, DEVICE_NAME);
+        kmem_cache_destroy(work_cache);
+        kmem_cache_destroy(object_cache);
+        destroy_buffer_caches();
 
         printk(KERN_INFO "%s: new device unregistered, it was assigned major number %d\n",MODNAME, Major);
 
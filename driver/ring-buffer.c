@@ -0,0 +1,198 @@
+/*
+ * @file ring-buffer.c
+ * @brief shared ring for the high priority flow of multi-flow device driver
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include "lib/defines.h"
+
+/**
+ * alloc_ring - allocation of shared ring
+ * 
+ * The area is allocated with vmalloc_user, so it is zeroed and can be
+ * mapped in user space.
+ * 
+ * Returns pointer to ring, NULL if allocation fails.
+ */
+ring_t *alloc_ring(void)
+{
+        ring_t *ring;
+
+        ring = kmalloc(sizeof(ring_t), GFP_KERNEL);
+        if (unlikely(!ring))
+                return NULL;
+
+        ring->area = vmalloc_user(RING_AREA_SIZE);
+        if (unlikely(!ring->area)) {
+                kfree(ring);
+                return NULL;
+        }
+
+        ring->header = (ring_header_t *)ring->area;
+        ring->data = (char *)ring->area + RING_HEADER_SIZE;
+        ring->header->size = RING_DATA_SIZE;
+
+        return ring;
+}
+
+/**
+ * ring_used - number of bytes in ring
+ * @ring:       pointer to ring
+ * 
+ * Indexes are written by user space too, so the result is clamped to
+ * the size of data area.
+ * 
+ * Returns number of bytes to read.
+ */
+int ring_used(ring_t *ring)
+{
+        unsigned int used;
+
+        used = smp_load_acquire(&(ring->header->producer)) - READ_ONCE(ring->header->consumer);
+
+        return min_t(unsigned int, used, RING_DATA_SIZE);
+}
+
+/**
+ * ring_mark_waiter - count a waiter in the header of ring
+ * @ring:       pointer to ring
+ * @writer:     true for a producer waiting for space, false for a consumer
+ * @delta:      1 before the waiter sleeps, -1 once it is woken
+ * 
+ * The counter is shared with user space waiters, so it is updated with
+ * an atomic operation on the mapped header. The caller must check the
+ * ring again after the counter is raised: a side that moves an index
+ * after the check sees the waiter and notifies it.
+ */
+void ring_mark_waiter(ring_t *ring, bool writer, int delta)
+{
+        unsigned int old;
+        unsigned int *waiting;
+
+        waiting = writer ? &(ring->header->writer_waiting) : &(ring->header->reader_waiting);
+
+        do {
+                old = READ_ONCE(*waiting);
+        } while (cmpxchg(waiting, old, old + delta) != old);
+
+        return;
+}
+
+/**
+ * write_ring - copy user data in ring
+ * @ring:       pointer to ring
+ * @from:       iterator over user data to write
+ * @len:        number of bytes to write, not greater than free space
+ * 
+ * The caller holds tail_mutex, so page faults are disabled. The producer
+ * index is published after the copy.
+ * 
+ * Returns number of bytes copied.
+ */
+int write_ring(ring_t *ring, struct iov_iter *from, int len)
+{
+        int to_copy;
+        int copied;
+        int byte_copied;
+        unsigned int offset;
+        unsigned int producer;
+
+        producer = READ_ONCE(ring->header->producer);
+        byte_copied = 0;
+
+        pagefault_disable();
+
+        while (byte_copied < len) {
+                offset = (producer + byte_copied) & (RING_DATA_SIZE - 1);
+                to_copy = min_t(int, len - byte_copied, RING_DATA_SIZE - offset);
+
+                copied = copy_from_iter(ring->data + offset, to_copy, from);
+                byte_copied += copied;
+
+                if (copied < to_copy)
+                        break;
+        }
+
+        pagefault_enable();
+
+        smp_store_release(&(ring->header->producer), producer + byte_copied);
+
+        return byte_copied;
+}
+
+/**
+ * read_ring - copy ring data to user
+ * @ring:       pointer to ring
+ * @to:         iterator over user memory that receives read data
+ * @len:        number of bytes to read, not greater than used space
+ * 
+ * The caller holds head_mutex, so page faults are disabled. The consumer
+ * index is published after the copy.
+ * 
+ * Returns number of bytes read.
+ */
+int read_ring(ring_t *ring, struct iov_iter *to, int len)
+{
+        int to_read;
+        int copied;
+        int byte_read;
+        unsigned int offset;
+        unsigned int consumer;
+
+        consumer = READ_ONCE(ring->header->consumer);
+        byte_read = 0;
+
+        pagefault_disable();
+
+        while (byte_read < len) {
+                offset = (consumer + byte_read) & (RING_DATA_SIZE - 1);
+                to_read = min_t(int, len - byte_read, RING_DATA_SIZE - offset);
+
+                copied = copy_to_iter(ring->data + offset, to_read, to);
+                byte_read += copied;
+
+                if (copied < to_read)
+                        break;
+        }
+
+        pagefault_enable();
+
+        smp_store_release(&(ring->header->consumer), consumer + byte_read);
+
+        return byte_read;
+}
+
+/**
+ * mmap_ring - map ring in user space
+ * @ring:       pointer to ring
+ * @vma:        user area, it must cover the whole ring from offset 0
+ * 
+ * Returns 0 if the operation is successful, otherwise a negative value.
+ */
+int mmap_ring(ring_t *ring, struct vm_area_struct *vma)
+{
+        if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != RING_AREA_SIZE)
+                return -EINVAL;
+
+        return remap_vmalloc_range(vma, ring->area, 0);
+}
+
+/**
+ * free_ring - free a shared ring
+ * @ring:       pointer to ring to free
+ */
+void free_ring(ring_t *ring)
+{
+        vfree(ring->area);
+        kfree(ring);
+
+        return;
+}
@@ -0,0 +1,41 @@
+#!/bin/bash
+
+# if less than two arguments supplied, display usage 
+if [ $# -lt 2 ] 
+then 
+    echo "Usage: ${0} SECONDS SIZE [BASELINE (default: the single lock driver)]"
+    exit 1
+fi
+
+# the driver before the split of op_mutex in head and tail mutexes
+baseline=${3:-998b8ac^}
+repo=$(git -C "$(dirname "$0")" rev-parse --show-toplevel)
+results=$repo/bench-results.txt
+
+(cd $repo/user && make bench > /dev/null) || exit 1
+
+: > $results
+
+for rev in $baseline HEAD
+do
+	tree=$(mktemp -d)
+	git -C $repo worktree add --detach $tree $rev > /dev/null || exit 1
+	(cd $tree/driver && make > /dev/null) || exit 1
+
+	insmod $tree/driver/multi-flow-driver.ko || exit 1
+	major=$(awk '$2 == "multi-flow" && $3 == "device" { print $1 }' /proc/devices)
+	node=$tree/multi-flow-bench
+	mknod $node c $major 0
+
+	for priority in 1 0
+	do
+		echo "$(git -C $repo log -1 --format='%h %s' $rev), priority $priority" | tee -a $results
+		$repo/user/bench $node $priority $1 $2 | tail -n 2 | tee -a $results
+	done
+
+	rm -f $node
+	rmmod multi_flow_driver
+	git -C $repo worktree remove --force $tree
+done
+
+echo "results are in $results"
@@ -7,18 +7,24 @@ then
     exit 1
 fi
 
-if [ $1 -lt 0 -o $1 -gt 127 ]
+minors=$(cat /sys/module/multi_flow_driver/parameters/minors)
+flows=$(cat /sys/module/multi_flow_driver/parameters/flows)
+
+if [ $1 -lt 0 -o $1 -ge $minors ]
 then
-	echo "The minor must be a number between 0 to 127."
+	echo "The minor must be a number between 0 to $(($minors-1))."
 	exit 1
 fi
 
-if [ $2 -lt 0 -o $2 -gt 1 ]
+if [ $2 -lt 0 -o $2 -ge $flows ]
 then
-	echo "The priority must be 0 (LOW) or 1 (HIGH)."
+	echo "The priority must be a number between 0 (LOW) to $(($flows-1))."
  	exit 1
 fi
 
-index=$(($2*128+$1+1))
+index=$(($2*$minors+$1+1))
+
+# the module parameter holds one page, debugfs holds the whole view
+values=$(cat /sys/module/multi_flow_driver/parameters/byte_in_buffer 2>/dev/null) || values=$(cat /sys/kernel/debug/multi-flow/byte_in_buffer)
 
-cut -d, -f $index /sys/module/multi_flow_driver/parameters/byte_in_buffer
+echo "$values" | cut -d, -f $index
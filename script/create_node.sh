@@ -7,9 +7,11 @@ then
     exit 1
 fi
 
-if [ $3 -lt 0 -o $3 -gt 127 ]
+minors=$(cat /sys/module/multi_flow_driver/parameters/minors)
+
+if [ $3 -lt 0 -o $3 -gt $minors ]
 then
-	echo "The minor must be a number between 0 to 127."
+	echo "The minor must be a number between 0 to $minors, $minors is the control node."
 	exit 1
 fi
 
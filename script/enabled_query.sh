@@ -7,9 +7,11 @@ then
     exit 1
 fi
 
-if [ $1 -lt 0 -o $1 -gt 127 ]
+minors=$(cat /sys/module/multi_flow_driver/parameters/minors)
+
+if [ $1 -lt 0 -o $1 -ge $minors ]
 then
-	echo "The minor must be a number between 0 to 127."
+	echo "The minor must be a number between 0 to $(($minors-1))."
 	exit 1
 fi
 
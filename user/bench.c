@@ -0,0 +1,176 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "lib/user.h"
+
+#define MAX_SIZE 65536
+#define WAIT_USEC 100000        // blocked calls give up after it, so threads see the end of the run
+
+typedef struct info_thread {
+        char *path;
+        int priority;
+        int size;
+        long bytes;
+        long calls;
+        struct timespec start;
+        struct timespec end;
+} info_thread_t;
+
+int running = 1;
+
+/*
+ * is_running - check if the run is not over, the flag is written by main
+ */
+int is_running(void)
+{
+        return __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * elapsed_of - seconds measured by a thread
+ */
+double elapsed_of(info_thread_t *info)
+{
+        return (info->end.tv_sec - info->start.tv_sec) + (info->end.tv_nsec - info->start.tv_nsec) / 1e9;
+}
+
+/*
+ * open_session - open a blocking session on the flow to measure
+ */
+int open_session(info_thread_t *info)
+{
+        int fd;
+
+        fd = open(info->path, O_RDWR);
+        if (fd == -1) {
+                printf("open error on device %s\n", info->path);
+                return -1;
+        }
+
+        if (info->priority == 0)
+                turn_to_low_priority(fd);
+        else
+                turn_to_high_priority(fd);
+
+        set_blocking_operations(fd);
+
+        // drivers without high resolution timeouts take seconds
+        if (set_timeout_usec(fd, WAIT_USEC))
+                set_timeout(fd, 1);
+
+        return fd;
+}
+
+void *producer(void *arg)
+{
+        int fd;
+        int byte;
+        char content[MAX_SIZE];
+        info_thread_t *info = (info_thread_t *)arg;
+
+        fd = open_session(info);
+        if (fd == -1)
+                return NULL;
+
+        memset(content, 'a', info->size);
+
+        clock_gettime(CLOCK_MONOTONIC, &info->start);
+
+        while (is_running()) {
+                byte = write(fd, content, info->size);
+                if (byte > 0)
+                        info->bytes += byte;
+                info->calls++;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &info->end);
+
+        close(fd);
+
+        return NULL;
+}
+
+void *consumer(void *arg)
+{
+        int fd;
+        int byte;
+        char content[MAX_SIZE];
+        info_thread_t *info = (info_thread_t *)arg;
+
+        fd = open_session(info);
+        if (fd == -1)
+                return NULL;
+
+        clock_gettime(CLOCK_MONOTONIC, &info->start);
+
+        while (is_running()) {
+                byte = read(fd, content, info->size);
+                if (byte > 0)
+                        info->bytes += byte;
+                info->calls++;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &info->end);
+
+        close(fd);
+
+        return NULL;
+}
+
+int main(int argc, char** argv)
+{
+        int seconds;
+        pthread_t tid[2];
+        info_thread_t info[2];
+
+        if (argc < 5) {
+                printf("usage: pathname priority seconds size\n");
+                return -1;
+        }
+
+        seconds = strtol(argv[3],NULL,10);
+
+        for (int i = 0; i < 2; i++) {
+                info[i].path = argv[1];
+                info[i].priority = strtol(argv[2],NULL,10) ? 1 : 0;
+                info[i].size = strtol(argv[4],NULL,10);
+                info[i].bytes = 0;
+                info[i].calls = 0;
+                info[i].start.tv_sec = info[i].end.tv_sec = 0;
+                info[i].start.tv_nsec = info[i].end.tv_nsec = 0;
+
+                if (info[i].size <= 0 || info[i].size > MAX_SIZE) {
+                        printf("size must be between 1 and %d\n", MAX_SIZE);
+                        return -1;
+                }
+        }
+
+        printf("one producer and one consumer on device %s, %s priority, %d byte per call\n",
+                argv[1], info[0].priority ? "high" : "low", info[0].size);
+
+        pthread_create(&tid[0],NULL,producer,&info[0]);
+        pthread_create(&tid[1],NULL,consumer,&info[1]);
+
+        sleep(seconds);
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+
+        // each thread stops within WAIT_USEC, its counters are read once it is joined
+        pthread_join(tid[0],NULL);
+        pthread_join(tid[1],NULL);
+
+        for (int i = 0; i < 2; i++) {
+                if (elapsed_of(&info[i]) <= 0)
+                        continue;
+
+                printf("%s %ld byte in %ld calls: %.0f byte/s\n", i ? "read" : "written",
+                        info[i].bytes, info[i].calls, info[i].bytes / elapsed_of(&info[i]));
+        }
+
+        return 0;
+}
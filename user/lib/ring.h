@@ -0,0 +1,122 @@
+#ifndef RING_H
+#define RING_H
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "user.h"
+
+/* layout of the shared ring, it must match the driver */
+#define RING_HEADER_SIZE        4096
+#define RING_DATA_SIZE          (32*4096)
+#define RING_AREA_SIZE          (RING_HEADER_SIZE + RING_DATA_SIZE)
+
+typedef struct ring_header {
+        unsigned int producer __attribute__((aligned(64)));
+        unsigned int consumer __attribute__((aligned(64)));
+        unsigned int size __attribute__((aligned(64)));
+        unsigned int reader_waiting;
+        unsigned int writer_waiting;
+} ring_header_t;
+
+/* map the ring of the high priority flow, after set_ring_mode(fd) */
+static inline ring_header_t *ring_map(int fd)
+{
+        void *area;
+
+        area = mmap(NULL, RING_AREA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (area == MAP_FAILED)
+                return NULL;
+
+        return (ring_header_t *)area;
+}
+
+#define ring_data(header)       ((char *)(header) + RING_HEADER_SIZE)
+
+/* write up to len bytes without entering the kernel, except to wake a sleeping reader */
+static inline int ring_write(int fd, ring_header_t *header, const char *buff, int len)
+{
+        unsigned int producer, consumer, offset;
+        int to_copy, first;
+
+        producer = header->producer;
+        consumer = __atomic_load_n(&header->consumer, __ATOMIC_ACQUIRE);
+
+        to_copy = RING_DATA_SIZE - (producer - consumer);
+        if (len < to_copy)
+                to_copy = len;
+        if (to_copy == 0)
+                return 0;
+
+        offset = producer & (RING_DATA_SIZE - 1);
+        first = RING_DATA_SIZE - offset < to_copy ? RING_DATA_SIZE - offset : to_copy;
+        memcpy(ring_data(header) + offset, buff, first);
+        memcpy(ring_data(header), buff + first, to_copy - first);
+
+        __atomic_store_n(&header->producer, producer + to_copy, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&header->reader_waiting, __ATOMIC_RELAXED))
+                ring_notify(fd);
+
+        return to_copy;
+}
+
+/* read up to len bytes without entering the kernel, except to wake a sleeping writer */
+static inline int ring_read(int fd, ring_header_t *header, char *buff, int len)
+{
+        unsigned int producer, consumer, offset;
+        int to_copy, first;
+
+        consumer = header->consumer;
+        producer = __atomic_load_n(&header->producer, __ATOMIC_ACQUIRE);
+
+        to_copy = producer - consumer;
+        if (len < to_copy)
+                to_copy = len;
+        if (to_copy == 0)
+                return 0;
+
+        offset = consumer & (RING_DATA_SIZE - 1);
+        first = RING_DATA_SIZE - offset < to_copy ? RING_DATA_SIZE - offset : to_copy;
+        memcpy(buff, ring_data(header) + offset, first);
+        memcpy(buff + first, ring_data(header), to_copy - first);
+
+        __atomic_store_n(&header->consumer, consumer + to_copy, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&header->writer_waiting, __ATOMIC_RELAXED))
+                ring_notify(fd);
+
+        return to_copy;
+}
+
+/* sleep until the ring is not empty, waiters are counted since the driver counts its own too */
+static inline void ring_wait_data(int fd, ring_header_t *header)
+{
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        __atomic_fetch_add(&header->reader_waiting, 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&header->producer, __ATOMIC_ACQUIRE) == header->consumer)
+                poll(&pfd, 1, -1);
+
+        __atomic_fetch_sub(&header->reader_waiting, 1, __ATOMIC_RELAXED);
+}
+
+/* sleep until the ring is not full */
+static inline void ring_wait_space(int fd, ring_header_t *header)
+{
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+
+        __atomic_fetch_add(&header->writer_waiting, 1, __ATOMIC_SEQ_CST);
+
+        if (header->producer - __atomic_load_n(&header->consumer, __ATOMIC_ACQUIRE) == RING_DATA_SIZE)
+                poll(&pfd, 1, -1);
+
+        __atomic_fetch_sub(&header->writer_waiting, 1, __ATOMIC_RELAXED);
+}
+
+#endif
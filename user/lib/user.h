@@ -7,5 +7,58 @@
 #define set_blocking_operations(fd)     ioctl(fd, 5)
 #define set_unblocking_operations(fd)   ioctl(fd, 6)
 #define set_timeout(fd, value)          ioctl(fd, 7, value)
+#define set_ring_mode(fd)               ioctl(fd, 8)
+#define ring_notify(fd)                 ioctl(fd, 9)
+#define set_read_lowat(fd, value)       ioctl(fd, 10, value)
+#define set_write_lowat(fd, value)      ioctl(fd, 11, value)
+#define set_timeout_usec(fd, value)     ioctl(fd, 12, value)
+#define set_timeout_nsec(fd, value)     ioctl(fd, 13, value)
+#define set_deadline(fd, timespec)      ioctl(fd, 14, timespec)
+#define set_busy_poll(fd, value)        ioctl(fd, 15, value)
+#define set_sharded_mode(fd, mode)      ioctl(fd, 16, mode)
+#define set_unified_read(fd, weight)    ioctl(fd, 17, weight)
+#define set_priority(fd, value)         ioctl(fd, 18, value)
+#define set_broadcast_mode(fd, lag)     ioctl(fd, 19, lag)
+#define peek_next_read(fd)              ioctl(fd, 20)
+#define discard(fd, len)                ioctl(fd, 21, len)
+#define set_record_mode(fd)             ioctl(fd, 22)
+#define read_records(fd, batch)         ioctl(fd, 23, batch)
+#define submit(fd, batch)               ioctl(fd, 24, batch)
+#define group_join(fd, join)            ioctl(fd, 25, join)
+#define group_source(fd)                ioctl(fd, 26)
+#define drain(fd)                       ioctl(fd, 27)
+
+/* modes of set_sharded_mode */
+#define SHARD_BY_WRITER                 1
+#define SHARD_BY_CPU                    2
+
+/* argument of read_records */
+typedef struct record_batch {
+        void *buffer;
+        unsigned long size;
+        unsigned int *lengths;
+        unsigned int count;
+} record_batch_t;
+
+/* entry of submit, entries with the same vectors share the payload */
+typedef struct submit_entry {
+        unsigned int minor;
+        unsigned int flow;
+        const struct iovec *iov;
+        unsigned int iovcnt;
+} submit_entry_t;
+
+/* argument of submit, to use on the control node */
+typedef struct submit_batch {
+        const submit_entry_t *entries;
+        long *results;
+        unsigned int count;
+} submit_batch_t;
+
+/* argument of group_join */
+typedef struct group_join {
+        unsigned int minor;
+        unsigned int weight;
+} group_join_t;
 
 #endif
\ No newline at end of file
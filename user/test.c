@@ -1,17 +1,32 @@
+#ifdef TEST_23
+#define _GNU_SOURCE
+#endif
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <sys/syscall.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include "lib/user.h"
+#ifdef TEST_8
+#include "lib/ring.h"
+#endif
+#ifdef TEST_22
+#include <poll.h>
+#endif
 
 #define MINOR_NUMBER 128
 #define DATA "ciao\n"
 #define SIZE strlen(DATA)
+#define CONTROL_PATH "/dev/multi-flow-ctl"
+#define MAX_BYTE_IN_BUFFER (32*4096)
 
 char *to_write[10] = {"a","b","c","d","e","f","g","h","i","l"};
 
@@ -68,6 +83,394 @@ void *the_thread(void* path)
         turn_to_low_priority(fd);
         written_bytes = write(fd, to_write[info->id], 1);
         printf("ho prenotato %d byte\n", written_bytes);
+#elif defined TEST_7
+        int byte;
+        struct iovec iov[2];
+        if (info->id != 0) {
+                iov[0].iov_base = content_read;
+                iov[0].iov_len = 2;
+                iov[1].iov_base = content_read + 2;
+                iov[1].iov_len = 2;
+                byte = readv(fd, iov, 2);
+                content_read[byte > 0 ? byte : 0] = '\0';
+                printf("ho letto %s (%d byte)\n", content_read, byte);
+        } else {
+                iov[0].iov_base = DATA;
+                iov[0].iov_len = SIZE;
+                iov[1].iov_base = DATA;
+                iov[1].iov_len = SIZE;
+                byte = writev(fd, iov, 2);
+                printf("ho scritto %d byte\n", byte);
+        }
+#elif defined TEST_8
+        int byte;
+        ring_header_t *ring;
+        set_ring_mode(fd);
+        ring = ring_map(fd);
+        if (ring == NULL) {
+                printf("mmap error on device %s\n", info->path);
+                return NULL;
+        }
+        if (info->id != 0) {
+                byte = read(fd, content_read, 4);
+                content_read[byte > 0 ? byte : 0] = '\0';
+                printf("ho letto %s (%d byte)\n", content_read, byte);
+        } else {
+                byte = ring_write(fd, ring, DATA, SIZE);
+                printf("ho scritto %d byte nel ring\n", byte);
+        }
+#elif defined TEST_9
+        int ctl;
+        int byte;
+        int total;
+        long result;
+        struct stat st;
+        struct iovec iov;
+        submit_entry_t entry;
+        submit_batch_t batch;
+        if (info->id != 0) {
+                set_broadcast_mode(fd, 0);
+                sleep(2);
+                set_unblocking_operations(fd);
+                total = 0;
+                while ((byte = read(fd, content_read, 4096)) > 0)
+                        total += byte;
+                printf("ho letto %d byte, attesi %d\n", total, (int)(2 * SIZE));
+        } else {
+                sleep(1);
+                // the payload goes after a write that leaves spare space in the tail chunk
+                byte = write(fd, DATA, SIZE);
+                fstat(fd, &st);
+                ctl = open(CONTROL_PATH, O_RDWR);
+                iov.iov_base = DATA;
+                iov.iov_len = SIZE;
+                entry.minor = minor(st.st_rdev);
+                entry.flow = 1;
+                entry.iov = &iov;
+                entry.iovcnt = 1;
+                batch.entries = &entry;
+                batch.results = &result;
+                batch.count = 1;
+                printf("ho scritto %d byte, submit con esito %d (%ld byte)\n", byte, submit(ctl, &batch), result);
+                close(ctl);
+        }
+#elif defined TEST_10
+        int fd2;
+        int byte;
+        long total;
+        if (info->id != 0)
+                return NULL;
+        // the cursor of the session is dropped when it moves to another flow
+        set_broadcast_mode(fd, 0);
+        turn_to_low_priority(fd);
+        fd2 = open(info->path, O_RDWR);
+        set_unblocking_operations(fd2);
+        total = 0;
+        while (total <= 2 * MAX_BYTE_IN_BUFFER && (byte = write(fd2, content_read, sizeof(content_read))) > 0)
+                total += byte;
+        printf("ho scritto %ld byte, capacità %d: %s\n", total, MAX_BYTE_IN_BUFFER,
+                total > MAX_BYTE_IN_BUFFER ? "ok" : "errore");
+        close(fd2);
+#elif defined TEST_22
+        int byte;
+        struct pollfd pfd;
+        // the reader sleeps in poll until the flow of its session holds data
+        if (info->id != 0) {
+                pfd.fd = fd;
+                pfd.events = POLLIN;
+                byte = poll(&pfd, 1, 5000);
+                printf("poll con esito %d, eventi %s\n", byte, pfd.revents & POLLIN ? "POLLIN" : "nessuno");
+                byte = read(fd, content_read, 4);
+                content_read[byte > 0 ? byte : 0] = '\0';
+                printf("ho letto %s (%d byte)\n", content_read, byte);
+        } else {
+                sleep(1);
+                byte = write(fd, DATA, SIZE);
+                printf("ho scritto %d byte\n", byte);
+        }
+#elif defined TEST_23
+        int byte;
+        int pipefd[2];
+        // the pipe gets the chunks of the flow, then the data is read from the pipe
+        if (info->id != 0) {
+                pipe(pipefd);
+                byte = splice(fd, NULL, pipefd[1], NULL, 4096, 0);
+                printf("ho spostato %d byte nella pipe\n", byte);
+                byte = read(pipefd[0], content_read, 4096);
+                content_read[byte > 0 ? byte : 0] = '\0';
+                printf("ho letto %s (%d byte) dalla pipe\n", content_read, byte);
+                close(pipefd[0]);
+                close(pipefd[1]);
+        } else {
+                sleep(1);
+                byte = write(fd, DATA, SIZE);
+                printf("ho scritto %d byte\n", byte);
+        }
+#elif defined TEST_24
+        int byte;
+        int total;
+        // many small deferred writes are flushed in one batch, after flush_delay_ms
+        turn_to_low_priority(fd);
+        if (info->id != 0) {
+                sleep(1);
+                set_unblocking_operations(fd);
+                total = 0;
+                while ((byte = read(fd, content_read, 4096)) > 0)
+                        total += byte;
+                printf("ho letto %d byte, attesi 100\n", total);
+        } else {
+                total = 0;
+                for (int i = 0; i < 100; i++)
+                        total += write(fd, to_write[i % 10], 1);
+                printf("ho scritto %d byte differiti\n", total);
+        }
+#elif defined TEST_25
+        int byte;
+        int total;
+        // the deferred writes of a minor are flushed in the order they were made
+        turn_to_low_priority(fd);
+        if (info->id != 0) {
+                sleep(1);
+                set_unblocking_operations(fd);
+                total = 0;
+                while ((byte = read(fd, content_read + total, sizeof(content_read) - 1 - total)) > 0)
+                        total += byte;
+                content_read[total] = '\0';
+                printf("ho letto %s, atteso abcdefghil\n", content_read);
+        } else {
+                for (int i = 0; i < 10; i++) {
+                        write(fd, to_write[i], 1);
+                        usleep(1000);
+                }
+                printf("ho scritto 10 byte differiti\n");
+        }
+#elif defined TEST_26
+        int byte;
+        struct stat st;
+        if (info->id != 0)
+                return NULL;
+        // the state of a minor with data survives the close of its last session
+        printf("nodo di controllo %s\n", stat(CONTROL_PATH, &st) == 0 ? "presente" : "assente");
+        byte = write(fd, DATA, SIZE);
+        printf("ho scritto %d byte\n", byte);
+        close(fd);
+        fd = open(info->path, O_RDWR);
+        set_unblocking_operations(fd);
+        byte = read(fd, content_read, 4096);
+        content_read[byte > 0 ? byte : 0] = '\0';
+        printf("ho letto %s (%d byte) dopo la riapertura\n", content_read, byte);
+#elif defined TEST_11
+        int byte;
+        // the reader wakes up only once both writes are in the flow
+        if (info->id != 0) {
+                set_read_lowat(fd, 2 * SIZE);
+                byte = read(fd, content_read, 4096);
+                printf("ho letto %d byte, attesi %d\n", byte, (int)(2 * SIZE));
+        } else {
+                set_write_lowat(fd, SIZE);
+                byte = write(fd, DATA, SIZE);
+                printf("ho scritto %d byte\n", byte);
+                sleep(1);
+                byte = write(fd, DATA, SIZE);
+                printf("ho scritto %d byte\n", byte);
+        }
+#elif defined TEST_12
+        int byte;
+        long elapsed;
+        struct timespec start;
+        struct timespec end;
+        struct timespec deadline;
+        if (info->id != 0)
+                return NULL;
+        // reads on the empty flow give up after 200 ms, 50 ms and at the deadline in 300 ms
+        for (int i = 0; i < 3; i++) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (i == 0) {
+                        set_timeout_usec(fd, 200000);
+                } else if (i == 1) {
+                        set_timeout_nsec(fd, 50000000);
+                } else {
+                        deadline = start;
+                        deadline.tv_nsec += 300000000;
+                        if (deadline.tv_nsec >= 1000000000) {
+                                deadline.tv_sec++;
+                                deadline.tv_nsec -= 1000000000;
+                        }
+                        set_deadline(fd, &deadline);
+                }
+                byte = read(fd, content_read, 4);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                elapsed = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+                printf("ho letto %d byte dopo %ld ms, attesi %d ms\n", byte, elapsed, i == 0 ? 200 : i == 1 ? 50 : 300);
+        }
+#elif defined TEST_13
+        int byte;
+        // the reader spins up to 100 us before sleeping on the flow
+        if (info->id != 0) {
+                set_busy_poll(fd, 100);
+                byte = read(fd, content_read, 4);
+                content_read[byte > 0 ? byte : 0] = '\0';
+                printf("ho letto %s (%d byte)\n", content_read, byte);
+        } else {
+                sleep(1);
+                byte = write(fd, DATA, SIZE);
+                printf("ho scritto %d byte\n", byte);
+        }
+#elif defined TEST_14
+        int byte;
+        int total;
+        // writers append to the sub-queue of their CPU, the reader merges them by write time
+        if (info->id != 0) {
+                sleep(1);
+                byte = write(fd, to_write[info->id % 10], 1);
+                printf("ho scritto %d byte\n", byte);
+        } else {
+                printf("modalità sharded con esito %d\n", set_sharded_mode(fd, SHARD_BY_CPU));
+                sleep(2);
+                set_unblocking_operations(fd);
+                total = 0;
+                while ((byte = read(fd, content_read + total, sizeof(content_read) - 1 - total)) > 0)
+                        total += byte;
+                content_read[total] = '\0';
+                printf("ho letto %s (%d byte)\n", content_read, total);
+        }
+#elif defined TEST_15
+        int byte;
+        int total;
+        // one session reads both flows, the high priority one first
+        if (info->id != 0) {
+                sleep(1);
+                set_unified_read(fd, 1);
+                set_unblocking_operations(fd);
+                total = 0;
+                while ((byte = read(fd, content_read + total, sizeof(content_read) - 1 - total)) > 0)
+                        total += byte;
+                content_read[total] = '\0';
+                printf("ho letto %s (%d byte)\n", content_read, total);
+        } else {
+                turn_to_low_priority(fd);
+                byte = write(fd, to_write[0], 1);
+                turn_to_high_priority(fd);
+                byte += write(fd, to_write[1], 1);
+                printf("ho scritto %d byte\n", byte);
+        }
+#elif defined TEST_16
+        int byte;
+        // the flow 2 exists only when the module is loaded with flows=3 or more
+        printf("priorità 2 con esito %d\n", set_priority(fd, 2));
+        if (info->id != 0) {
+                byte = read(fd, content_read, 4);
+                content_read[byte > 0 ? byte : 0] = '\0';
+                printf("ho letto %s (%d byte)\n", content_read, byte);
+        } else {
+                byte = write(fd, DATA, SIZE);
+                printf("ho scritto %d byte\n", byte);
+        }
+#elif defined TEST_17
+        int byte;
+        // every subscriber reads the whole write
+        if (info->id != 0) {
+                set_broadcast_mode(fd, 0);
+                byte = read(fd, content_read, 4);
+                content_read[byte > 0 ? byte : 0] = '\0';
+                printf("ho letto %s (%d byte)\n", content_read, byte);
+        } else {
+                sleep(1);
+                byte = write(fd, DATA, SIZE);
+                printf("ho scritto %d byte\n", byte);
+        }
+#elif defined TEST_18
+        int byte;
+        if (info->id != 0)
+                return NULL;
+        // a peek on the empty flow holds for the next read, that finds data
+        set_unblocking_operations(fd);
+        peek_next_read(fd);
+        byte = read(fd, content_read, 4);
+        printf("ho sbirciato il flusso vuoto (%d byte)\n", byte);
+        // a peeked read leaves data in the flow, a discard drops it without copy
+        byte = write(fd, DATA, SIZE);
+        printf("ho scritto %d byte\n", byte);
+        byte = read(fd, content_read, 4);
+        content_read[byte > 0 ? byte : 0] = '\0';
+        printf("ho sbirciato %s (%d byte)\n", content_read, byte);
+        printf("ho scartato %d byte\n", discard(fd, 2));
+        byte = read(fd, content_read, 4);
+        content_read[byte > 0 ? byte : 0] = '\0';
+        printf("ho letto %s (%d byte), attesi %d\n", content_read, byte, (int)(SIZE - 2));
+#elif defined TEST_19
+        int byte;
+        int count;
+        unsigned int lengths[10];
+        record_batch_t batch;
+        if (info->id != 0)
+                return NULL;
+        // every write is a record, a batch reads them whole with their lengths
+        printf("modalità record con esito %d\n", set_record_mode(fd));
+        for (int i = 0; i < 3; i++) {
+                byte = write(fd, DATA, i + 1);
+                printf("ho scritto un record di %d byte\n", byte);
+        }
+        batch.buffer = content_read;
+        batch.size = sizeof(content_read);
+        batch.lengths = lengths;
+        batch.count = 10;
+        count = read_records(fd, &batch);
+        for (int i = 0; i < count; i++)
+                printf("record %d di %u byte\n", i, lengths[i]);
+        printf("ho letto %d record, attesi 3\n", count);
+#elif defined TEST_20
+        int ctl;
+        int byte;
+        long result;
+        struct stat st;
+        struct iovec iov;
+        group_join_t join;
+        submit_entry_t entry;
+        submit_batch_t batch;
+        // the session reads its minor and the next one, that gets data from the control node
+        fstat(fd, &st);
+        join.minor = minor(st.st_rdev) + 1;
+        join.weight = 1;
+        if (info->id != 0) {
+                printf("gruppo con esito %d\n", group_join(fd, &join));
+                byte = read(fd, content_read, 4);
+                content_read[byte > 0 ? byte : 0] = '\0';
+                printf("ho letto %s (%d byte) dal minor %d, atteso %u\n", content_read, byte,
+                        group_source(fd), join.minor);
+        } else {
+                sleep(1);
+                ctl = open(CONTROL_PATH, O_RDWR);
+                iov.iov_base = DATA;
+                iov.iov_len = SIZE;
+                entry.minor = join.minor;
+                entry.flow = 1;
+                entry.iov = &iov;
+                entry.iovcnt = 1;
+                batch.entries = &entry;
+                batch.results = &result;
+                batch.count = 1;
+                printf("submit con esito %d (%ld byte)\n", submit(ctl, &batch), result);
+                close(ctl);
+        }
+#elif defined TEST_21
+        int fd2;
+        int byte;
+        if (info->id != 0)
+                return NULL;
+        // writes to the low priority flow are deferred until a drain or fsync
+        turn_to_low_priority(fd);
+        fd2 = open(info->path, O_RDWR);
+        turn_to_low_priority(fd2);
+        set_unblocking_operations(fd2);
+        for (int i = 0; i < 2; i++) {
+                byte = write(fd, DATA, SIZE);
+                printf("ho scritto %d byte, %s con esito %d\n", byte, i ? "fsync" : "drain",
+                        i ? fsync(fd) : drain(fd));
+                byte = read(fd2, content_read, 4096);
+                printf("ho letto %d byte, attesi %d\n", byte, (int)SIZE);
+        }
+        close(fd2);
 #endif
 
         return NULL;